@@ -0,0 +1,240 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_CALLBACK_REGISTRY_H
+#define ILMPCLIENT_ILMP_CALLBACK_REGISTRY_H
+
+#include <vector>
+#include <ostream>
+
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+
+// IlmpCallbackRegistry holds the callbacks registered on a stream together with their
+// server-side reference counts, and owns them: callbacks are disposed of through their
+// destroy() method.
+//
+// Callback ids are handed out sequentially per pageview, starting at 1, and are never
+// reused. Each pageview therefore keeps its callbacks in a vector indexed by id, offset
+// by the ids at the front that are gone already. An id doubles as the generation of its
+// slot: a slot is only a hit when the callback in it still carries the id looked up.
+// Lookup, refcount updates and removal are O(1) and entries need no node allocations.
+// Pageviews with small ids are indexed directly; others are hashed.
+//
+// Once most slots are dead, the front half of the vector is dropped. The few callbacks
+// still alive in it, typically long-lived ones such as stream subscriptions, move to a
+// map, so they do not keep the vector from following the window of live ids.
+//
+// Callback is IlmpCallback; it is a parameter so this header does not depend on IlmpStream.h.
+template <class Callback>
+class IlmpCallbackRegistry : boost::noncopyable {
+public:
+	struct Entry {
+		int refCount;
+		Callback* cb;
+		Entry() : refCount(0), cb(0) {}
+	};
+
+	IlmpCallbackRegistry() {}
+
+	~IlmpCallbackRegistry() { clear(); }
+
+	// Takes ownership of cb, assigning it the next id of its pageview when it has none yet.
+	int add(Callback* cb)
+	{
+		Pageview& pv = *pageview(cb->pageviewId, true);
+		if (!cb->id)
+			// Following js-implementation, just increment, starting at 1.
+			cb->id = ++pv.callbackAt;
+
+		Entry* e;
+		if (cb->id < pv.base)
+			e = &pv.moved[cb->id]; // Only for ids assigned by the caller; ours only go up.
+		else {
+			if (pv.slots.empty())
+				pv.base = cb->id;
+			size_t i = cb->id - pv.base;
+			if (i >= pv.slots.size())
+				pv.slots.resize(i + 1);
+			e = &pv.slots[i];
+			if (!e->cb)
+				pv.live++;
+		}
+
+		if (e->cb && e->cb != cb)
+			e->cb->destroy(); // Same id registered twice; the old one is overwritten, like before.
+		e->refCount = 1;
+		e->cb = cb;
+		return cb->id;
+	}
+
+	// Returns the id the next callback of a pageview is assigned.
+	int nextId(int pageviewId)
+	{
+		Pageview* pv = pageview(pageviewId, false);
+		return pv ? pv->callbackAt + 1 : 1;
+	}
+
+	// Returns the entry of a live callback, or 0.
+	Entry* find(int pageviewId, int callbackId)
+	{
+		Pageview* pv = pageview(pageviewId, false);
+		if (!pv)
+			return 0;
+		if (callbackId < pv->base) {
+			typename boost::unordered_map<int, Entry>::iterator it = pv->moved.find(callbackId);
+			return it != pv->moved.end() && isLive(it->second, callbackId) ? &it->second : 0;
+		}
+		if (callbackId - pv->base >= (int)pv->slots.size())
+			return 0;
+		Entry& e = pv->slots[callbackId - pv->base];
+		return isLive(e, callbackId) ? &e : 0;
+	}
+
+	// Destructs the callback and frees its slot.
+	void remove(int pageviewId, int callbackId)
+	{
+		Entry* e = find(pageviewId, callbackId);
+		if (!e)
+			return;
+		
+		Callback* cb = e->cb;
+		Pageview& pv = *pageview(pageviewId, false);
+		if (callbackId < pv.base)
+			pv.moved.erase(callbackId);
+		else {
+			e->cb = 0;
+			e->refCount = 0;
+			pv.live--;
+			if (pv.slots.size() >= 64 && pv.live * 2 <= pv.slots.size())
+				compact(pv);
+		}
+
+		cb->destroy(); // Last, as the destructor may re-enter the registry.
+	}
+
+	// Destructs all callbacks and forgets all pageviews. Returns the number of callbacks.
+	int clear()
+	{
+		int n = 0;
+		for (typename std::vector<Pageview>::iterator it = dense.begin(); it != dense.end(); it++)
+			n += clearPageview(*it);
+		for (typename boost::unordered_map<int, Pageview>::iterator it = sparse.begin(); it != sparse.end(); it++)
+			n += clearPageview(it->second);
+		dense.clear();
+		sparse.clear();
+		return n;
+	}
+
+	// Dumps all live callbacks in readable format.
+	void debugPrint(std::ostream& out) const
+	{
+		for (size_t i = 0; i < dense.size(); i++)
+			printPageview(out, i, dense[i]);
+		for (typename boost::unordered_map<int, Pageview>::const_iterator it = sparse.begin(); it != sparse.end(); it++)
+			printPageview(out, it->first, it->second);
+	}
+
+private:
+	struct Pageview {
+		int callbackAt; // Last id handed out
+		int base; // Id of slots[0]
+		size_t live; // Number of live slots
+		std::vector<Entry> slots;
+		boost::unordered_map<int, Entry> moved; // Live callbacks with ids below base
+		Pageview() : callbackAt(0), base(1), live(0) {}
+	};
+
+	static const int denseIds = 64;
+	std::vector<Pageview> dense; // pageviewId -> Pageview, for 0 <= pageviewId < denseIds
+	boost::unordered_map<int, Pageview> sparse;
+
+	static bool isLive(const Entry& e, int callbackId) { return e.cb && e.cb->id == callbackId; }
+
+	Pageview* pageview(int pageviewId, bool create)
+	{
+		if (pageviewId >= 0 && pageviewId < denseIds) {
+			if ((int)dense.size() <= pageviewId) {
+				if (!create) return 0;
+				dense.resize(pageviewId + 1);
+			}
+			return &dense[pageviewId];
+		}
+		if (create)
+			return &sparse[pageviewId];
+		typename boost::unordered_map<int, Pageview>::iterator it = sparse.find(pageviewId);
+		return it == sparse.end() ? 0 : &it->second;
+	}
+
+	// Drops the front half of the slots, moving the live callbacks in it aside.
+	static void compact(Pageview& pv)
+	{
+		size_t half = pv.slots.size() / 2;
+		for (size_t i = 0; i < half; i++) {
+			if (pv.slots[i].cb) {
+				pv.moved[pv.base + (int)i] = pv.slots[i];
+				pv.live--;
+			}
+		}
+		pv.slots.erase(pv.slots.begin(), pv.slots.begin() + half);
+		pv.base += half;
+	}
+
+	static int clearPageview(Pageview& pv)
+	{
+		// Detach all entries first; destructors may look at the registry.
+		std::vector<Entry> slots;
+		slots.swap(pv.slots);
+		for (typename boost::unordered_map<int, Entry>::iterator it = pv.moved.begin(); it != pv.moved.end(); it++)
+			slots.push_back(it->second);
+		pv.moved.clear();
+		pv.live = 0;
+		
+		int n = 0;
+		for (typename std::vector<Entry>::iterator it = slots.begin(); it != slots.end(); it++) {
+			if (it->cb) {
+				it->cb->destroy();
+				n++;
+			}
+		}
+		return n;
+	}
+
+	static void printPageview(std::ostream& out, int pageviewId, const Pageview& pv)
+	{
+		bool header = false;
+		for (typename boost::unordered_map<int, Entry>::const_iterator it = pv.moved.begin(); it != pv.moved.end(); it++) {
+			if (!header) {
+				out << "  pageviewId=" << pageviewId << ":\n";
+				header = true;
+			}
+			out << "    cbId=" << it->first << ", refCnt=" << it->second.refCount << "\n";
+		}
+		for (size_t i = 0; i < pv.slots.size(); i++) {
+			const Entry& e = pv.slots[i];
+			if (!e.cb) continue;
+			if (!header) {
+				out << "  pageviewId=" << pageviewId << ":\n";
+				header = true;
+			}
+			out << "    cbId=" << (pv.base + (int)i) << ", refCnt=" << e.refCount << "\n";
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_CODEC_H
+#define ILMPCLIENT_ILMP_CODEC_H
+
+#include <string>
+#include <cstring>
+
+// Parameter escaping. The ILMP separators \x00..\x05 may not appear in a parameter, so they
+// are sent as \x05 followed by the ascii digit of the char: "\x05" "0" .. "\x05" "5".
+//
+// Escaping spends nearly all its time looking for the next char to escape, so that search
+// is done a vector register at a time: with SSE2 when the compiler targets it, and with
+// AVX2 when the compiler supports it and the cpu running us has it. Unescaping looks for
+// \x05 with memchr, which the C library vectorizes already.
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ILMP_CODEC_SSE2
+#endif
+
+// AVX2 is compiled through the target attribute and picked at runtime. Left out on
+// Windows, where gcc does not align the stack for 32-byte spills.
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(_WIN32) && !defined(__clang__) \
+		&& (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#define ILMP_CODEC_AVX2
+#endif
+
+// IlmpCodec holds the escaping routines; it has static members only.
+class IlmpCodec {
+public:
+	static bool needsEscape(char c) {
+		return (unsigned char)c <= 5;
+	}
+
+	// The implementations of the search for chars to escape.
+	enum Path {
+		scalar,
+		sse2,
+		avx2
+	};
+
+	// Appends [first, last) to out, escaped. Runs of plain chars are appended in one go.
+	static void appendEscaped(std::string& out, const char* first, const char* last) {
+		appendEscaped(out, first, last, findEscapeFunc());
+	}
+
+	// Same, through the given path, to compare the paths; false when this build or cpu does
+	// not have it.
+	static bool appendEscaped(std::string& out, const char* first, const char* last, Path path) {
+		FindEscapeFunc find = findEscapeFunc(path);
+		if (!find)
+			return false;
+		appendEscaped(out, first, last, find);
+		return true;
+	}
+
+	static void appendEscaped(std::string& out, const std::string& s) {
+		appendEscaped(out, s.data(), s.data() + s.size());
+	}
+
+	// Returns the size of [first, last) once escaped.
+	static size_t escapedSize(const char* first, const char* last) {
+		FindEscapeFunc find = findEscapeFunc();
+		size_t size = last - first;
+		for (const char* p; (p = find(first, last)) != last; first = p + 1)
+			size++;
+		return size;
+	}
+
+	static size_t escapedSize(const std::string& s) {
+		return escapedSize(s.data(), s.data() + s.size());
+	}
+
+	// Unescapes [first, last) in place and returns the new end. A \x05 that is not followed
+	// by a digit 0..5 is left as it is.
+	static char* unescapeInPlace(char* first, char* last) {
+		char* p = static_cast<char*>(memchr(first, '\x05', last - first));
+		if (!p)
+			return last;
+
+		char* out = first;
+		while (p) {
+			if (out != first)
+				memmove(out, first, p - first);
+			out += p - first;
+			if (last - p >= 2 && p[1] >= '0' && p[1] <= '5') {
+				*out++ = p[1] - '0';
+				first = p + 2;
+			}
+			else {
+				*out++ = *p;
+				first = p + 1;
+			}
+			p = static_cast<char*>(memchr(first, '\x05', last - first));
+		}
+		memmove(out, first, last - first);
+		return out + (last - first);
+	}
+
+private:
+	typedef const char* (*FindEscapeFunc)(const char*, const char*);
+
+	static void appendEscaped(std::string& out, const char* first, const char* last, FindEscapeFunc find) {
+		for (const char* p; (p = find(first, last)) != last; first = p + 1) {
+			out.append(first, p);
+			char r[] = {'\x05', (char)('0' + *p)};
+			out.append(r, 2);
+		}
+		out.append(first, last);
+	}
+
+	// Each returns the first char in [p, end) that needs escaping, or end.
+	static const char* findEscapeScalar(const char* p, const char* end) {
+		while (p != end && !needsEscape(*p))
+			p++;
+		return p;
+	}
+
+#ifdef ILMP_CODEC_SSE2
+	static const char* findEscapeSse2(const char* p, const char* end) {
+		// c <= 5 (unsigned) exactly when min(c, 5) == c.
+		const __m128i five = _mm_set1_epi8(5);
+		for (; end - p >= 16; p += 16) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, five), v));
+			if (mask)
+				return p + __builtin_ctz(mask);
+		}
+		return findEscapeScalar(p, end);
+	}
+#endif
+
+#ifdef ILMP_CODEC_AVX2
+	__attribute__((target("avx2")))
+	static const char* findEscapeAvx2(const char* p, const char* end) {
+		const __m256i five = _mm256_set1_epi8(5);
+		for (; end - p >= 32; p += 32) {
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+			unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, five), v));
+			if (mask)
+				return p + __builtin_ctz(mask);
+		}
+		return findEscapeScalar(p, end);
+	}
+#endif
+
+	// The best search this build and cpu support, chosen on first use.
+	static FindEscapeFunc findEscapeFunc() {
+		static FindEscapeFunc f = 0;
+		if (!f) {
+#ifdef ILMP_CODEC_SSE2
+			f = findEscapeSse2;
+#else
+			f = findEscapeScalar;
+#endif
+#ifdef ILMP_CODEC_AVX2
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2"))
+				f = findEscapeAvx2;
+#endif
+		}
+		return f;
+	}
+
+	static FindEscapeFunc findEscapeFunc(Path path) {
+		if (path == scalar)
+			return findEscapeScalar;
+#ifdef ILMP_CODEC_SSE2
+		if (path == sse2)
+			return findEscapeSse2;
+#endif
+#ifdef ILMP_CODEC_AVX2
+		__builtin_cpu_init();
+		if (path == avx2 && __builtin_cpu_supports("avx2"))
+			return findEscapeAvx2;
+#endif
+		return 0;
+	}
+};
+
+#endif
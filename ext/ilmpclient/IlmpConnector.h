@@ -0,0 +1,198 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_CONNECTOR_H
+#define ILMPCLIENT_ILMP_CONNECTOR_H
+
+#include <vector>
+#include <iostream>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+
+// Time between the starts of two connection attempts, in milliseconds.
+#ifndef ILMP_CONNECT_DELAY
+#define ILMP_CONNECT_DELAY 250
+#endif
+
+using boost::asio::ip::tcp;
+
+// IlmpConnector connects to the first of a set of resolved endpoints that answers, racing
+// them ("happy eyeballs"): the endpoints are ordered alternating between IPv6 and IPv4, and
+// an attempt is started every delay, or as soon as the previous one fails, without waiting
+// for the earlier ones to time out. The first attempt to succeed wins and the others are
+// cancelled, so a dead address delays the connect by no more than the delay.
+//
+// Like IlmpStream, an IlmpConnector is referenced through a boost::shared_ptr, as its
+// outstanding operations refer to it. E.g.
+//
+//	boost::shared_ptr<IlmpConnector> connector(new IlmpConnector(ioService));
+//	connector->connect(endpoint_itr, tcp::endpoint(), handler);
+class IlmpConnector : boost::noncopyable, public boost::enable_shared_from_this<IlmpConnector> {
+public:
+	// Invoked once when connected, passing the socket, which the handler takes over; or,
+	// when all attempts failed, with the last error and no socket. Not invoked after cancel().
+	typedef boost::function<void(const boost::system::error_code&, tcp::socket*)> Handler;
+
+	IlmpConnector(boost::asio::io_service& ioService_, int delay_ = ILMP_CONNECT_DELAY) :
+			ioService(ioService_), timer(ioService_), delay(boost::posix_time::milliseconds(delay_)),
+			next(0), pending(0), done(false) {}
+
+	~IlmpConnector() {
+		closeSockets();
+	}
+
+	// Connects to one of the endpoints from endpoint_itr on, starting with preferred when it
+	// is among them.
+	void connect(tcp::resolver::iterator endpoint_itr, const tcp::endpoint& preferred, const Handler& handler_) {
+		std::vector<tcp::endpoint> resolved;
+		for (; endpoint_itr != tcp::resolver::iterator(); ++endpoint_itr)
+			resolved.push_back(*endpoint_itr);
+		connect(resolved, preferred, handler_);
+	}
+
+	void connect(const std::vector<tcp::endpoint>& resolved, const tcp::endpoint& preferred, const Handler& handler_) {
+		handler = handler_;
+		order(resolved, preferred);
+		sockets.assign(endpoints.size(), 0);
+		if (endpoints.empty()) {
+			ioService.post(boost::bind(&IlmpConnector::finish, shared_from_this(),
+					boost::system::error_code(boost::asio::error::host_not_found), -1));
+			return;
+		}
+		startNext();
+	}
+
+	// Stops all attempts; the handler is released without being invoked.
+	void cancel() {
+		done = true;
+		handler = Handler();
+		timer.cancel();
+		closeSockets();
+	}
+
+private:
+	boost::asio::io_service& ioService;
+	boost::asio::deadline_timer timer;
+	boost::posix_time::time_duration delay;
+
+	Handler handler;
+	std::vector<tcp::endpoint> endpoints;
+	std::vector<tcp::socket*> sockets; // Socket of each attempt that is running
+	size_t next; // Next endpoint to try
+	int pending; // Attempts running
+	bool done;
+	boost::system::error_code lastError;
+
+	// Orders the endpoints preferred first, then alternating between the address families,
+	// starting with the family of the first endpoint (the resolver's preference).
+	void order(const std::vector<tcp::endpoint>& resolved, const tcp::endpoint& preferred) {
+		std::vector<tcp::endpoint> first, second;
+		bool hasPreferred = false;
+		for (std::vector<tcp::endpoint>::const_iterator it = resolved.begin(); it != resolved.end(); it++) {
+			const tcp::endpoint& endpoint = *it;
+			if (preferred.port() && endpoint == preferred)
+				hasPreferred = true;
+			else if (first.empty() || endpoint.protocol() == first.front().protocol())
+				first.push_back(endpoint);
+			else
+				second.push_back(endpoint);
+		}
+
+		endpoints.clear();
+		if (hasPreferred)
+			endpoints.push_back(preferred);
+		for (size_t i = 0; i < first.size() || i < second.size(); i++) {
+			if (i < first.size()) endpoints.push_back(first[i]);
+			if (i < second.size()) endpoints.push_back(second[i]);
+		}
+	}
+
+	void startNext() {
+		size_t i = next++;
+		sockets[i] = new tcp::socket(ioService);
+		pending++;
+		sockets[i]->async_connect(endpoints[i], boost::bind(&IlmpConnector::onConnect, shared_from_this(),
+				i, boost::asio::placeholders::error));
+
+		if (next < endpoints.size()) {
+			timer.expires_from_now(delay);
+			timer.async_wait(boost::bind(&IlmpConnector::onTimer, shared_from_this(), boost::asio::placeholders::error));
+		}
+	}
+
+	void onTimer(const boost::system::error_code& err) {
+		if (done || err == boost::asio::error::operation_aborted || next >= endpoints.size())
+			return;
+		startNext();
+	}
+
+	void onConnect(size_t i, const boost::system::error_code& err) {
+		pending--;
+		if (done)
+			return;
+
+		if (!err) {
+			finish(err, i);
+			return;
+		}
+
+		std::cerr << "Unable to connect to '" << endpoints[i] << "': " << err.message() << std::endl;
+		delete sockets[i];
+		sockets[i] = 0;
+		lastError = err;
+		if (next < endpoints.size()) {
+			// Don't wait for the delay to pass.
+			timer.cancel();
+			startNext();
+		}
+		else if (!pending)
+			finish(lastError, -1);
+	}
+
+	// Hands the socket of attempt i, if any, to the handler, and stops the other attempts.
+	void finish(const boost::system::error_code& err, int i) {
+		if (done)
+			return;
+		tcp::socket* socket = 0;
+		if (i >= 0) {
+			socket = sockets[i];
+			sockets[i] = 0;
+		}
+		Handler h;
+		h.swap(handler);
+		cancel();
+		h(err, socket);
+	}
+
+	void closeSockets() {
+		for (std::vector<tcp::socket*>::iterator it = sockets.begin(); it != sockets.end(); it++) {
+			if (*it) {
+				boost::system::error_code err;
+				(*it)->close(err);
+				delete *it;
+				*it = 0;
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_DISPATCH_TABLE_H
+#define ILMPCLIENT_ILMP_DISPATCH_TABLE_H
+
+#include <string>
+#include <vector>
+
+#include "TokenWalker.h"
+
+// IlmpDispatchTable maps the command names of a callback to their handlers (any Value,
+// typically a member function pointer) through a perfect hash: build() searches a hash seed
+// under which all names land in different slots, so find() hashes the token once and does
+// a single compare to confirm it, without building a std::string.
+template <class Value>
+class IlmpDispatchTable {
+public:
+	IlmpDispatchTable() : seed(0), mask(0) {}
+
+	// Adds a name; build() must be called after the last one.
+	void add(const char* name, Value value) {
+		entries.push_back(Entry());
+		entries.back().name = name;
+		entries.back().value = value;
+		slots.clear();
+	}
+
+	void build() {
+		size_t size = 1;
+		while (size < entries.size() * 2)
+			size <<= 1;
+		// A few hundred seeds nearly always do; otherwise spread out over more slots.
+		for (;; size <<= 1) {
+			for (seed = 1; seed <= 256; seed++) {
+				if (tryBuild(size))
+					return;
+			}
+		}
+	}
+
+	// Returns the value of name, or Value() when it is unknown.
+	Value find(const StringRef& name) const {
+		if (slots.empty())
+			return Value();
+		const Entry* e = slots[hash(name, seed) & mask];
+		return e && StringRef(e->name) == name ? e->value : Value();
+	}
+
+private:
+	struct Entry {
+		std::string name;
+		Value value;
+	};
+
+	std::vector<Entry> entries;
+	std::vector<const Entry*> slots;
+	unsigned seed;
+	size_t mask;
+
+	// FNV-1a, seeded, with a final mix so the low bits depend on all chars.
+	static unsigned hash(const StringRef& s, unsigned seed) {
+		unsigned h = 2166136261u ^ (seed * 0x9e3779b9u);
+		for (const char* p = s.begin(); p != s.end(); p++) {
+			h ^= (unsigned char)*p;
+			h *= 16777619u;
+		}
+		return h ^ (h >> 15);
+	}
+
+	bool tryBuild(size_t size) {
+		slots.assign(size, 0);
+		mask = size - 1;
+		for (typename std::vector<Entry>::const_iterator it = entries.begin(); it != entries.end(); it++) {
+			const Entry*& slot = slots[hash(it->name, seed) & mask];
+			if (slot && slot->name == it->name)
+				continue; // Added twice; the first one wins
+			if (slot) {
+				slots.clear();
+				return false;
+			}
+			slot = &*it;
+		}
+		return true;
+	}
+};
+
+#endif
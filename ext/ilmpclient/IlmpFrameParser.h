@@ -0,0 +1,57 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_FRAME_PARSER_H
+#define ILMPCLIENT_ILMP_FRAME_PARSER_H
+
+#include <cstring>
+
+#include "TokenWalker.h"
+
+// IlmpFrameParser splits a block of received data into '\001'-terminated frames in a
+// single scan, handing out StringRefs into the block instead of copies. Empty frames are
+// skipped. An incomplete frame at the end of the block is left alone; consumed() tells the
+// caller how many bytes it may discard, so the remainder is completed by the next read.
+class IlmpFrameParser {
+public:
+	IlmpFrameParser(const char* begin, const char* end) : start(begin), pos(begin), last(end) {}
+
+	bool next(StringRef& frame) {
+		while (pos != last) {
+			const char* term = static_cast<const char*>(memchr(pos, '\001', last - pos));
+			if (!term)
+				return false; // Incomplete trailing frame
+			
+			frame = StringRef(pos, term);
+			pos = term + 1;
+			if (!frame.empty())
+				return true;
+		}
+		return false;
+	}
+
+	// Number of bytes taken up by the frames walked so far, including their terminators.
+	size_t consumed() const { return pos - start; }
+
+private:
+	const char* start;
+	const char* pos;
+	const char* last;
+};
+
+#endif
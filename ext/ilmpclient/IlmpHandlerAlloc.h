@@ -0,0 +1,155 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_HANDLER_ALLOC_H
+#define ILMPCLIENT_ILMP_HANDLER_ALLOC_H
+
+#include <cstddef>
+#include <new>
+
+#include <boost/version.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/aligned_storage.hpp>
+
+#define ILMP_HANDLER_MEMORY_SIZE 512
+
+// IlmpHandlerMemory is a block of memory that is recycled for the handlers of a sequence
+// of asynchronous operations, of which at most one is outstanding at any time (all reads
+// of a connection, for instance). asio allocates the state of an operation through its
+// handler; wrapping the handler with makeAllocHandler makes that state live here instead
+// of on the heap. Allocations that do not fit, or that are made while the block is
+// taken, fall back to the heap.
+class IlmpHandlerMemory : boost::noncopyable {
+public:
+	IlmpHandlerMemory() : inUse(false) {}
+
+	void* allocate(std::size_t size) {
+		if (!inUse && size <= sizeof(storage)) {
+			inUse = true;
+			return storage.address();
+		}
+		return ::operator new(size);
+	}
+
+	void deallocate(void* p) {
+		if (p == storage.address())
+			inUse = false;
+		else
+			::operator delete(p);
+	}
+
+private:
+	boost::aligned_storage<ILMP_HANDLER_MEMORY_SIZE> storage;
+	bool inUse;
+};
+
+// Standard allocator on top of IlmpHandlerMemory, for asio's associated allocator lookup.
+template <class T>
+class IlmpHandlerAllocator {
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef std::size_t size_type;
+	typedef std::ptrdiff_t difference_type;
+
+	template <class U> struct rebind { typedef IlmpHandlerAllocator<U> other; };
+
+	explicit IlmpHandlerAllocator(IlmpHandlerMemory& memory_) : memory(&memory_) {}
+
+	template <class U>
+	IlmpHandlerAllocator(const IlmpHandlerAllocator<U>& other) : memory(other.memory) {}
+
+	T* allocate(std::size_t n) { return static_cast<T*>(memory->allocate(sizeof(T) * n)); }
+	void deallocate(T* p, std::size_t) { memory->deallocate(p); }
+
+	template <class U>
+	bool operator==(const IlmpHandlerAllocator<U>& other) const { return memory == other.memory; }
+	template <class U>
+	bool operator!=(const IlmpHandlerAllocator<U>& other) const { return memory != other.memory; }
+
+	IlmpHandlerMemory* memory;
+};
+
+// Wraps a completion handler so the operation it completes allocates from an
+// IlmpHandlerMemory. Newer asio versions pick up get_allocator(), older versions the
+// asio_handler_allocate hooks.
+template <class Handler>
+class IlmpAllocHandler {
+public:
+	typedef IlmpHandlerAllocator<Handler> allocator_type;
+
+	IlmpAllocHandler(IlmpHandlerMemory& memory_, const Handler& handler_) : memory(memory_), handler(handler_) {}
+
+	allocator_type get_allocator() const { return allocator_type(memory); }
+
+	void operator()() { handler(); }
+
+	template <class Arg1>
+	void operator()(const Arg1& arg1) { handler(arg1); }
+
+	template <class Arg1, class Arg2>
+	void operator()(const Arg1& arg1, const Arg2& arg2) { handler(arg1, arg2); }
+
+#if BOOST_VERSION < 106600
+	friend void* asio_handler_allocate(std::size_t size, IlmpAllocHandler<Handler>* h) {
+		return h->memory.allocate(size);
+	}
+
+	friend void asio_handler_deallocate(void* p, std::size_t, IlmpAllocHandler<Handler>* h) {
+		h->memory.deallocate(p);
+	}
+#endif
+
+private:
+	IlmpHandlerMemory& memory;
+	Handler handler;
+};
+
+template <class Handler>
+inline IlmpAllocHandler<Handler> makeAllocHandler(IlmpHandlerMemory& memory, const Handler& handler)
+{
+	return IlmpAllocHandler<Handler>(memory, handler);
+}
+
+// Buffer sequence referring to a container of buffers that outlives the operation. asio
+// copies buffer sequences into its operations; passing the container itself would copy it.
+template <class Buffers>
+class IlmpBuffersRef {
+public:
+	typedef typename Buffers::value_type value_type;
+	typedef typename Buffers::const_iterator const_iterator;
+
+	explicit IlmpBuffersRef(const Buffers& buffers_) : buffers(&buffers_) {}
+
+	const_iterator begin() const { return buffers->begin(); }
+	const_iterator end() const { return buffers->end(); }
+
+private:
+	const Buffers* buffers;
+};
+
+template <class Buffers>
+inline IlmpBuffersRef<Buffers> buffersRef(const Buffers& buffers)
+{
+	return IlmpBuffersRef<Buffers>(buffers);
+}
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_JSON_H
+#define ILMPCLIENT_ILMP_JSON_H
+
+#include "TokenWalker.h"
+
+// Deepest nesting of arrays and objects IlmpJsonParser accepts.
+#ifndef ILMP_JSON_MAX_DEPTH
+#define ILMP_JSON_MAX_DEPTH 64
+#endif
+
+// IlmpJsonHandler receives the events of IlmpJsonParser, in document order. The StringRefs
+// point into the parsed buffer and are only valid during the call. Strings and keys are
+// unescaped; numbers are handed over as their text, for toInt or strtod.
+class IlmpJsonHandler {
+public:
+	virtual ~IlmpJsonHandler() {}
+
+	virtual void onNull() {}
+	virtual void onBool(bool /*value*/) {}
+	virtual void onNumber(const StringRef& /*text*/) {}
+	virtual void onString(const StringRef& /*value*/) {}
+	virtual void onKey(const StringRef& /*key*/) {}
+	virtual void onStartObject() {}
+	virtual void onEndObject() {}
+	virtual void onStartArray() {}
+	virtual void onEndArray() {}
+};
+
+// IlmpJsonParser is a streaming (SAX) JSON parser that works on the buffer in place: no DOM
+// is built and nothing is copied. Strings are unescaped within the buffer, which is why
+// it needs writable chars.
+class IlmpJsonParser {
+public:
+	// Parses the single JSON value in [first, last). Returns false when the input is not
+	// valid JSON; the events up to the error have been delivered then.
+	static bool parse(char* first, char* last, IlmpJsonHandler& handler) {
+		IlmpJsonParser parser(first, last, handler);
+		if (!parser.value(0))
+			return false;
+		parser.skipSpace();
+		return parser.p == parser.end;
+	}
+
+private:
+	char* p;
+	char* end;
+	IlmpJsonHandler& handler;
+
+	IlmpJsonParser(char* first, char* last, IlmpJsonHandler& handler_) : p(first), end(last), handler(handler_) {}
+
+	void skipSpace() {
+		while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+			p++;
+	}
+
+	bool literal(const char* word) {
+		for (; *word; word++, p++)
+			if (p == end || *p != *word)
+				return false;
+		return true;
+	}
+
+	bool value(int depth) {
+		skipSpace();
+		if (p == end)
+			return false;
+		switch (*p) {
+		case '{': return object(depth + 1);
+		case '[': return array(depth + 1);
+		case '"': {
+			StringRef s;
+			if (!string(s)) return false;
+			handler.onString(s);
+			return true;
+		}
+		case 't':
+			if (!literal("true")) return false;
+			handler.onBool(true);
+			return true;
+		case 'f':
+			if (!literal("false")) return false;
+			handler.onBool(false);
+			return true;
+		case 'n':
+			if (!literal("null")) return false;
+			handler.onNull();
+			return true;
+		default:
+			return number();
+		}
+	}
+
+	bool object(int depth) {
+		if (depth > ILMP_JSON_MAX_DEPTH)
+			return false;
+		p++; // '{'
+		handler.onStartObject();
+		skipSpace();
+		if (p != end && *p == '}') {
+			p++;
+			handler.onEndObject();
+			return true;
+		}
+		for (;;) {
+			skipSpace();
+			StringRef key;
+			if (p == end || *p != '"' || !string(key))
+				return false;
+			handler.onKey(key);
+			skipSpace();
+			if (p == end || *p++ != ':')
+				return false;
+			if (!value(depth))
+				return false;
+			skipSpace();
+			if (p == end)
+				return false;
+			if (*p == '}') {
+				p++;
+				handler.onEndObject();
+				return true;
+			}
+			if (*p++ != ',')
+				return false;
+		}
+	}
+
+	bool array(int depth) {
+		if (depth > ILMP_JSON_MAX_DEPTH)
+			return false;
+		p++; // '['
+		handler.onStartArray();
+		skipSpace();
+		if (p != end && *p == ']') {
+			p++;
+			handler.onEndArray();
+			return true;
+		}
+		for (;;) {
+			if (!value(depth))
+				return false;
+			skipSpace();
+			if (p == end)
+				return false;
+			if (*p == ']') {
+				p++;
+				handler.onEndArray();
+				return true;
+			}
+			if (*p++ != ',')
+				return false;
+		}
+	}
+
+	static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+	bool number() {
+		char* first = p;
+		if (p != end && *p == '-')
+			p++;
+		if (p == end || !isDigit(*p))
+			return false;
+		if (*p == '0')
+			p++;
+		else
+			while (p != end && isDigit(*p)) p++;
+		if (p != end && *p == '.') {
+			p++;
+			if (p == end || !isDigit(*p))
+				return false;
+			while (p != end && isDigit(*p)) p++;
+		}
+		if (p != end && (*p == 'e' || *p == 'E')) {
+			p++;
+			if (p != end && (*p == '+' || *p == '-'))
+				p++;
+			if (p == end || !isDigit(*p))
+				return false;
+			while (p != end && isDigit(*p)) p++;
+		}
+		handler.onNumber(StringRef(first, p));
+		return true;
+	}
+
+	static int hexDigit(char c) {
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	}
+
+	bool hex4(unsigned& u) {
+		if (end - p < 4)
+			return false;
+		u = 0;
+		for (int i = 0; i < 4; i++, p++) {
+			int d = hexDigit(*p);
+			if (d < 0) return false;
+			u = u << 4 | d;
+		}
+		return true;
+	}
+
+	// Writes code point u as UTF-8 at out, which lags far enough behind p: the escape
+	// sequence it came from is at least as long.
+	static char* putUtf8(char* out, unsigned u) {
+		if (u < 0x80)
+			*out++ = (char)u;
+		else if (u < 0x800) {
+			*out++ = (char)(0xc0 | u >> 6);
+			*out++ = (char)(0x80 | (u & 0x3f));
+		}
+		else if (u < 0x10000) {
+			*out++ = (char)(0xe0 | u >> 12);
+			*out++ = (char)(0x80 | (u >> 6 & 0x3f));
+			*out++ = (char)(0x80 | (u & 0x3f));
+		}
+		else {
+			*out++ = (char)(0xf0 | u >> 18);
+			*out++ = (char)(0x80 | (u >> 12 & 0x3f));
+			*out++ = (char)(0x80 | (u >> 6 & 0x3f));
+			*out++ = (char)(0x80 | (u & 0x3f));
+		}
+		return out;
+	}
+
+	// Parses the string at p and unescapes it in place; s refers to the result.
+	bool string(StringRef& s) {
+		char* first = ++p; // '"'
+		// Strings without escapes are the common case; they are left untouched.
+		while (p != end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+			p++;
+		char* out = p;
+		while (p != end) {
+			char c = *p++;
+			if (c == '"') {
+				s = StringRef(first, out);
+				return true;
+			}
+			if ((unsigned char)c < 0x20)
+				return false;
+			if (c != '\\') {
+				*out++ = c;
+				continue;
+			}
+			if (p == end)
+				return false;
+			switch (*p++) {
+			case '"': *out++ = '"'; break;
+			case '\\': *out++ = '\\'; break;
+			case '/': *out++ = '/'; break;
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u': {
+				unsigned u;
+				if (!hex4(u))
+					return false;
+				if (u >= 0xd800 && u < 0xdc00) {
+					// High surrogate; combine it with the low surrogate that should follow.
+					unsigned lo;
+					if (end - p < 2 || p[0] != '\\' || p[1] != 'u')
+						return false;
+					p += 2;
+					if (!hex4(lo) || lo < 0xdc00 || lo >= 0xe000)
+						return false;
+					u = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+				}
+				else if (u >= 0xdc00 && u < 0xe000)
+					return false;
+				out = putUtf8(out, u);
+				break;
+			}
+			default:
+				return false;
+			}
+		}
+		return false;
+	}
+};
+
+#endif
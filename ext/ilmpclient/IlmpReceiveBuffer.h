@@ -0,0 +1,83 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_RECEIVE_BUFFER_H
+#define ILMPCLIENT_ILMP_RECEIVE_BUFFER_H
+
+#include <cstring>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/noncopyable.hpp>
+
+// IlmpReceiveBuffer is a fixed-capacity buffer for received data. Reads go into the free
+// space after the data (prepare/commit), parsed frames are dropped from the front
+// (consume). The incomplete frame that is left over is moved to the front once the free
+// space runs short, so a frame is always contiguous and the buffer never grows: a frame
+// that does not fit the capacity shows as a full buffer, prepare() returning no space.
+class IlmpReceiveBuffer : boost::noncopyable {
+public:
+	IlmpReceiveBuffer() : buf(0), cap(0), head(0), tail(0) {}
+
+	~IlmpReceiveBuffer() { delete[] buf; }
+
+	// Discards the contents and makes sure the capacity is as given. Only allocates when
+	// the capacity changes.
+	void reset(size_t capacity) {
+		if (capacity != cap) {
+			delete[] buf;
+			buf = 0; cap = 0;
+			buf = new char[capacity];
+			cap = capacity;
+		}
+		clear();
+	}
+
+	void clear() { head = tail = 0; }
+
+	size_t capacity() const { return cap; }
+
+	char* data() { return buf + head; }
+	size_t size() const { return tail - head; }
+
+	void consume(size_t n) {
+		head += n < size() ? n : size();
+		if (head == tail)
+			head = tail = 0;
+	}
+
+	// Returns the free space after the data, compacting first when that is less than half
+	// of the capacity. Returns an empty buffer when the data fills the whole capacity.
+	boost::asio::mutable_buffers_1 prepare() {
+		if (head > 0 && cap - tail < cap / 2) {
+			memmove(buf, buf + head, tail - head);
+			tail -= head;
+			head = 0;
+		}
+		return boost::asio::mutable_buffers_1(buf + tail, cap - tail);
+	}
+
+	void commit(size_t n) { tail += n < cap - tail ? n : cap - tail; }
+
+private:
+	char* buf;
+	size_t cap;
+	size_t head; // Start of the data
+	size_t tail; // End of the data
+};
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_RECONNECT_SCHEDULER_H
+#define ILMPCLIENT_ILMP_RECONNECT_SCHEDULER_H
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+// Reconnect delays, in milliseconds, after the SPEC's min(600, 3 * 2 ^ failures) seconds.
+#ifndef ILMP_RECONNECT_BASE
+#define ILMP_RECONNECT_BASE 3000
+#endif
+#ifndef ILMP_RECONNECT_CAP
+#define ILMP_RECONNECT_CAP 600000
+#endif
+
+// Connection attempts admitted at once, and the interval at which another one is admitted
+// after that, in milliseconds.
+#ifndef ILMP_RECONNECT_BURST
+#define ILMP_RECONNECT_BURST 3
+#endif
+#ifndef ILMP_RECONNECT_REFILL
+#define ILMP_RECONNECT_REFILL 20000
+#endif
+
+// IlmpReconnectScheduler decides when to make the next connection attempt. The delay grows
+// exponentially with the failures in a row, as the SPEC suggests, but is drawn at random so
+// that clients dropped at the same time (by a server restart) spread their attempts instead
+// of coming back in the same second, and again at each doubling:
+//
+//	full jitter:         random(0, min(cap, base * 2 ^ failures))
+//	decorrelated jitter: min(cap, random(base, max(base, previous delay) * 3))
+//
+// A retry-after hint from the server sets the minimum of the next delay, jittered up to half
+// of it again. On top of that, a token bucket limits the attempts to burst at once and one
+// per refill interval after that. Time and seed can be passed in, so attempts can be
+// simulated.
+class IlmpReconnectScheduler {
+public:
+	enum Jitter {
+		fullJitter,
+		decorrelatedJitter
+	};
+
+	// With seed 0, the scheduler seeds itself.
+	IlmpReconnectScheduler(Jitter jitter_ = decorrelatedJitter, unsigned seed_ = 0) :
+			jitter(jitter_), base(ILMP_RECONNECT_BASE), cap(ILMP_RECONNECT_CAP),
+			burst(ILMP_RECONNECT_BURST), refillInterval(ILMP_RECONNECT_REFILL),
+			failures(0), previous(0), retryAfter(0), tokens(ILMP_RECONNECT_BURST), seed(seed_ ? seed_ : initialSeed()) {}
+
+	void setJitter(Jitter j) { jitter = j; }
+
+	// Sets the delays and the admission limit, in milliseconds.
+	void setDelays(int base_, int cap_) {
+		base = base_;
+		cap = cap_;
+	}
+
+	void setAdmission(int burst_, int refillInterval_) {
+		burst = tokens = burst_;
+		refillInterval = refillInterval_;
+	}
+
+	// Resets the delay after a successful connect.
+	void succeeded() {
+		failures = 0;
+		previous = 0;
+	}
+
+	// Makes the next delay at least ms.
+	void setRetryAfter(int ms) {
+		retryAfter = std::max(retryAfter, ms);
+	}
+
+	// Returns the delay before the next attempt, in milliseconds, counting the failure that
+	// led up to it, and takes the attempt's token.
+	int nextDelay(const boost::posix_time::ptime& now) {
+		int delay;
+		if (jitter == fullJitter) {
+			long ceiling = base;
+			for (int i = 0; i < failures && ceiling < cap; i++)
+				ceiling *= 2;
+			delay = randomBetween(0, (int)std::min(ceiling, (long)cap));
+		}
+		else
+			delay = std::min(cap, randomBetween(base, std::max(base, previous) * 3));
+		previous = delay;
+		failures++;
+
+		if (retryAfter) {
+			delay = std::max(delay, randomBetween(retryAfter, retryAfter + retryAfter / 2));
+			retryAfter = 0;
+		}
+
+		// Take a token at the time of the attempt, waiting for one when there are none.
+		boost::posix_time::ptime attempt = now + boost::posix_time::milliseconds(delay);
+		refill(attempt);
+		if (!tokens) {
+			attempt = refilled + boost::posix_time::milliseconds(refillInterval);
+			refill(attempt);
+			delay = (int)(attempt - now).total_milliseconds();
+		}
+		tokens--;
+		return delay;
+	}
+
+private:
+	Jitter jitter;
+	int base;
+	int cap;
+	int burst;
+	int refillInterval;
+
+	int failures; // Attempts failed in a row
+	int previous; // Previous delay
+	int retryAfter; // Hint for the next delay
+
+	int tokens;
+	boost::posix_time::ptime refilled; // Time the last token was added
+	unsigned seed;
+
+	void refill(const boost::posix_time::ptime& t) {
+		if (refilled.is_not_a_date_time() || tokens >= burst) {
+			refilled = t;
+			return;
+		}
+		long n = (t - refilled).total_milliseconds() / std::max(1, refillInterval);
+		if (n > 0) {
+			tokens = (int)std::min((long)burst, tokens + n);
+			refilled += boost::posix_time::milliseconds(refillInterval * n);
+		}
+	}
+
+	// Seeds differently per process and per scheduler, as clients dropped at the same time
+	// would otherwise all draw the same delays.
+	unsigned initialSeed() const {
+		unsigned s = (unsigned)boost::posix_time::microsec_clock::universal_time().time_of_day().total_microseconds();
+		s ^= (unsigned)(size_t)this;
+#ifdef _WIN32
+		s ^= (unsigned)_getpid() << 16;
+#else
+		s ^= (unsigned)getpid() << 16;
+#endif
+		return s;
+	}
+
+	// Returns a number in [low, high].
+	int randomBetween(int low, int high) {
+		seed = seed * 1103515245u + 12345u;
+		return low + (int)((double)(seed >> 8) / 16777216.0 * (high - low + 1));
+	}
+};
+
+#endif
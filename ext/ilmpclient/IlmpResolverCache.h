@@ -0,0 +1,199 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_RESOLVER_CACHE_H
+#define ILMPCLIENT_ILMP_RESOLVER_CACHE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <iostream>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+
+// Time resolved addresses are used without resolving again, in seconds. The system
+// resolver does not tell the TTL of the records, so a fixed one is used.
+#ifndef ILMP_RESOLVE_TTL
+#define ILMP_RESOLVE_TTL 300
+#endif
+
+// Time addresses are used at all after they were resolved, in seconds. Until then, expired
+// addresses are still handed out while they are being refreshed.
+#ifndef ILMP_RESOLVE_MAX_STALE
+#define ILMP_RESOLVE_MAX_STALE 86400
+#endif
+
+using boost::asio::ip::tcp;
+
+// IlmpResolverCache resolves host names for all streams and fetches of the process, so a
+// reconnect does not wait for DNS. Addresses within their TTL are handed out right away.
+// When the TTL runs out, the addresses of hosts asked for since the last resolve are
+// refreshed in the background; those of other hosts are refreshed when asked for next,
+// while the expired ones are handed out. Only
+// when there are no addresses (or very old ones), the caller waits for the resolver, along
+// with any others that asked for the same host in the meantime. When resolving fails, the
+// addresses known last keep being used.
+//
+// The cache also remembers the endpoint of each host that was last connected to, for
+// IlmpConnector to try first. It is to be used from one thread at a time.
+class IlmpResolverCache : boost::noncopyable {
+public:
+	typedef std::vector<tcp::endpoint> Endpoints;
+	typedef boost::function<void(const boost::system::error_code&, const Endpoints&)> Handler;
+
+	static IlmpResolverCache& instance() {
+		static IlmpResolverCache cache;
+		return cache;
+	}
+
+	// Invokes handler through ioService with the addresses of host.
+	void resolve(boost::asio::io_service& ioService, const std::string& host, const std::string& port, const Handler& handler) {
+		std::string k(key(host, port));
+		Entry& e = entries[k];
+		e.used = true;
+		stopped = false;
+		boost::posix_time::ptime t = now();
+		if (!e.endpoints.empty() && t < e.resolved + maxStale) {
+			ioService.post(boost::bind(handler, boost::system::error_code(), e.endpoints));
+			if (t >= e.resolved + ttl && !e.resolving)
+				start(ioService, host, port, k, e); // Refresh for the next time
+			return;
+		}
+
+		e.waiters.push_back(std::make_pair(&ioService, handler));
+		if (!e.resolving)
+			start(ioService, host, port, k, e);
+	}
+
+	// Sets the endpoint of host last connected to.
+	void setGood(const std::string& host, const std::string& port, const tcp::endpoint& endpoint) {
+		entries[key(host, port)].good = endpoint;
+	}
+
+	// Returns the endpoint of host last connected to, or an unspecified endpoint.
+	tcp::endpoint good(const std::string& host, const std::string& port) const {
+		std::map<std::string, Entry>::const_iterator it = entries.find(key(host, port));
+		return it == entries.end() ? tcp::endpoint() : it->second.good;
+	}
+
+	// Sets the TTL and maximum age of addresses, in seconds.
+	void setTtl(int ttl_, int maxStale_ = ILMP_RESOLVE_MAX_STALE) {
+		ttl = boost::posix_time::seconds(ttl_);
+		maxStale = boost::posix_time::seconds(maxStale_);
+	}
+
+	// Stops the background refreshes, so the io_services they run on can run out of work.
+	void stop() {
+		stopped = true;
+		for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); it++) {
+			if (boost::shared_ptr<boost::asio::deadline_timer> timer = it->second.refreshTimer.lock())
+				timer->cancel();
+		}
+	}
+
+	// Forgets all addresses, e.g. after a change of network.
+	void clear() {
+		for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); it++) {
+			it->second.endpoints.clear();
+			it->second.good = tcp::endpoint();
+		}
+	}
+
+private:
+	struct Entry {
+		Entry() : resolving(false), used(false) {}
+
+		Endpoints endpoints;
+		boost::posix_time::ptime resolved;
+		tcp::endpoint good;
+		bool resolving;
+		bool used; // Asked for since the last resolve
+		boost::weak_ptr<boost::asio::deadline_timer> refreshTimer; // Held by its handler
+		std::vector<std::pair<boost::asio::io_service*, Handler> > waiters; // Waiting for the resolver
+	};
+
+	std::map<std::string, Entry> entries; // "host:port" -> entry
+	boost::posix_time::time_duration ttl;
+	boost::posix_time::time_duration maxStale;
+	bool stopped; // No refreshes until the next resolve
+
+	IlmpResolverCache() : ttl(boost::posix_time::seconds(ILMP_RESOLVE_TTL)),
+			maxStale(boost::posix_time::seconds(ILMP_RESOLVE_MAX_STALE)), stopped(false) {}
+
+	static std::string key(const std::string& host, const std::string& port) {
+		return host + ":" + port;
+	}
+
+	static boost::posix_time::ptime now() {
+		return boost::posix_time::microsec_clock::universal_time();
+	}
+
+	void start(boost::asio::io_service& ioService, const std::string& host, const std::string& port, const std::string& k, Entry& e) {
+		e.resolving = true;
+		e.used = false;
+		boost::shared_ptr<tcp::resolver> resolver(new tcp::resolver(ioService));
+		tcp::resolver::query query(host, port);
+		resolver->async_resolve(query, boost::bind(&IlmpResolverCache::onResolve, this, &ioService, resolver, host, port, k,
+				boost::asio::placeholders::error, boost::asio::placeholders::iterator));
+	}
+
+	void onResolve(boost::asio::io_service* ioService, boost::shared_ptr<tcp::resolver> resolver, const std::string& host,
+			const std::string& port, const std::string& k, const boost::system::error_code& err, tcp::resolver::iterator endpoint_itr) {
+		Entry& e = entries[k];
+		e.resolving = false;
+		if (!err) {
+			e.endpoints.clear();
+			for (; endpoint_itr != tcp::resolver::iterator(); ++endpoint_itr)
+				e.endpoints.push_back(*endpoint_itr);
+			e.resolved = now();
+			if (!stopped && e.refreshTimer.expired()) {
+				// The timer lives in its handler only, so it goes with the io_service.
+				boost::shared_ptr<boost::asio::deadline_timer> timer(new boost::asio::deadline_timer(*ioService));
+				e.refreshTimer = timer;
+				timer->expires_at(e.resolved + ttl);
+				timer->async_wait(boost::bind(&IlmpResolverCache::onRefresh, this, ioService, timer, host, port, k,
+						boost::asio::placeholders::error));
+			}
+		}
+		else if (!e.endpoints.empty())
+			std::cerr << "Unable to resolve " << k << ": " << err.message() << "; using the addresses known last" << std::endl;
+
+		boost::system::error_code result(e.endpoints.empty() ? err : boost::system::error_code());
+		std::vector<std::pair<boost::asio::io_service*, Handler> > waiters;
+		waiters.swap(e.waiters);
+		for (size_t i = 0; i < waiters.size(); i++)
+			waiters[i].first->post(boost::bind(waiters[i].second, result, e.endpoints));
+	}
+
+	// Refreshes the addresses of k when its TTL runs out, if they were asked for since.
+	void onRefresh(boost::asio::io_service* ioService, boost::shared_ptr<boost::asio::deadline_timer> timer, const std::string& host,
+			const std::string& port, const std::string& k, const boost::system::error_code& err) {
+		Entry& e = entries[k];
+		e.refreshTimer.reset();
+		if (!err && e.used && !e.resolving)
+			start(*ioService, host, port, k, e);
+	}
+};
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_RPC_H
+#define ILMPCLIENT_ILMP_RPC_H
+
+#include <string>
+
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_same.hpp>
+#include <boost/type_traits/is_convertible.hpp>
+#include <boost/utility/enable_if.hpp>
+
+#include "IlmpStream.h"
+#include "IlmpCodec.h"
+
+// IlmpRpc describes a remote procedure by its name and parameter types, so that calling
+// it is checked by the compiler and takes a single pass: the encoding of each parameter
+// follows from its type, the frame size is computed up front so the frame buffer is sized
+// once, and the "pageviewId\002Msite|rpc" prefix comes from the stream's prefix cache. E.g.
+//
+//	IlmpRpc<std::string, int> log("Notifier.log");
+//	log(ilmp.get(), msg, 0);
+//
+// Supported parameter types are std::string (sent as 'p'), JsonString and int (sent as 'j')
+// and IlmpRpcCallback (sent as 'c').
+
+struct IlmpRpcNone {};
+
+// IlmpRpcCallback is a callback parameter: either an IlmpCallback, or a function that is
+// wrapped in an IlmpCallbackNativeFunc. When weakPtr is given, it is pointed to the callback
+// and reset when the callback is destructed, like IlmpCommand's operator>>.
+class IlmpRpcCallback {
+public:
+	IlmpRpcCallback(IlmpCallback* cb_, IlmpCallback** weakPtr_ = 0) : cb(cb_), weakPtr(weakPtr_) {}
+
+	template <class F>
+	IlmpRpcCallback(const F& f, IlmpCallback** weakPtr_ = 0,
+			typename boost::disable_if<boost::is_convertible<F, IlmpCallback*>, int>::type = 0) :
+			cb(0), func(f), weakPtr(weakPtr_) {}
+
+	IlmpCallback* cb;
+	IlmpCallbackNativeFunc::NativeFunc func;
+	IlmpCallback** weakPtr;
+};
+
+// Encoding of a parameter of type T: size() returns the number of chars append() adds.
+template <class T> struct IlmpRpcParam;
+
+template <> struct IlmpRpcParam<IlmpRpcNone> {
+	static size_t size(IlmpStream*, int, const IlmpRpcNone&) { return 0; }
+	static void append(IlmpStream*, int, std::string&, const IlmpRpcNone&) {}
+};
+
+template <> struct IlmpRpcParam<std::string> {
+	static size_t size(IlmpStream*, int, const std::string& s) { return 2 + IlmpCodec::escapedSize(s); }
+	static void append(IlmpStream*, int, std::string& out, const std::string& s) {
+		out.append("\003p", 2);
+		IlmpCodec::appendEscaped(out, s);
+	}
+};
+
+template <> struct IlmpRpcParam<JsonString> {
+	static size_t size(IlmpStream*, int, const JsonString& s) { return 2 + IlmpCodec::escapedSize(s); }
+	static void append(IlmpStream*, int, std::string& out, const JsonString& s) {
+		out.append("\003j", 2);
+		IlmpCodec::appendEscaped(out, s);
+	}
+};
+
+template <> struct IlmpRpcParam<int> {
+	static size_t size(IlmpStream*, int, int n) { return 2 + intSize(n); }
+	static void append(IlmpStream*, int, std::string& out, int n) {
+		out.append("\003j", 2);
+		appendInt(out, n);
+	}
+};
+
+class IlmpRpcBase {
+protected:
+	IlmpRpcBase(const char* name_, int pageviewId_, const char* siteDir_) :
+			name(name_), pageviewId(pageviewId_), siteDir(siteDir_) {}
+
+	// Borrows a frame buffer from stream, sized for paramsSize chars of parameters, and
+	// starts it with the prefix.
+	void beginFrame(IlmpStream* stream, std::string& frame, size_t paramsSize) const {
+		const std::string& prefix = stream->framePrefix(pageviewId, siteDir.empty() ? stream->siteDir : siteDir, name);
+		stream->acquireFrame(frame);
+		frame.reserve(prefix.size() + paramsSize + 1);
+		frame.append(prefix);
+	}
+
+	static void sendFrame(IlmpStream* stream, std::string& frame) {
+		frame.push_back('\001');
+		stream->writeFrame(frame);
+	}
+
+	static void appendCallback(IlmpStream* stream, int pageviewId, std::string& out, const IlmpRpcCallback& c) {
+		IlmpCallback* cb = c.cb ? c.cb : IlmpCallbackNativeFunc::create(stream, pageviewId, c.func);
+		stream->registerCallback(cb);
+		out.append("\003c", 2);
+		appendInt(out, cb->id);
+		if (c.weakPtr) {
+			*c.weakPtr = cb;
+			cb->addWeakRef(c.weakPtr);
+		}
+	}
+
+	template <class T> friend struct IlmpRpcParam;
+
+	const std::string name;
+	const int pageviewId;
+	const std::string siteDir;
+};
+
+template <> struct IlmpRpcParam<IlmpRpcCallback> {
+	// The id is assigned when the callback is registered; allow for the ones registered before
+	// it in the same frame.
+	static size_t size(IlmpStream* stream, int pageviewId, const IlmpRpcCallback& c) {
+		if (c.cb && c.cb->id)
+			return 2 + intSize(c.cb->id);
+		return 2 + intSize(stream->nextCallbackId(c.cb ? c.cb->pageviewId : pageviewId) + 3);
+	}
+	static void append(IlmpStream* stream, int pageviewId, std::string& out, const IlmpRpcCallback& c) {
+		IlmpRpcBase::appendCallback(stream, pageviewId, out, c);
+	}
+};
+
+template <class A1 = IlmpRpcNone, class A2 = IlmpRpcNone, class A3 = IlmpRpcNone, class A4 = IlmpRpcNone>
+class IlmpRpc : public IlmpRpcBase {
+public:
+	static const int arity = 4 - boost::is_same<A1, IlmpRpcNone>::value - boost::is_same<A2, IlmpRpcNone>::value
+			- boost::is_same<A3, IlmpRpcNone>::value - boost::is_same<A4, IlmpRpcNone>::value;
+
+	explicit IlmpRpc(const char* name_, int pageviewId_ = 1, const char* siteDir_ = "") :
+			IlmpRpcBase(name_, pageviewId_, siteDir_) {}
+
+	void operator()(IlmpStream* stream) const {
+		BOOST_STATIC_ASSERT(arity == 0);
+		send(stream, IlmpRpcNone(), IlmpRpcNone(), IlmpRpcNone(), IlmpRpcNone());
+	}
+
+	void operator()(IlmpStream* stream, const A1& a1) const {
+		BOOST_STATIC_ASSERT(arity == 1);
+		send(stream, a1, IlmpRpcNone(), IlmpRpcNone(), IlmpRpcNone());
+	}
+
+	void operator()(IlmpStream* stream, const A1& a1, const A2& a2) const {
+		BOOST_STATIC_ASSERT(arity == 2);
+		send(stream, a1, a2, IlmpRpcNone(), IlmpRpcNone());
+	}
+
+	void operator()(IlmpStream* stream, const A1& a1, const A2& a2, const A3& a3) const {
+		BOOST_STATIC_ASSERT(arity == 3);
+		send(stream, a1, a2, a3, IlmpRpcNone());
+	}
+
+	void operator()(IlmpStream* stream, const A1& a1, const A2& a2, const A3& a3, const A4& a4) const {
+		BOOST_STATIC_ASSERT(arity == 4);
+		send(stream, a1, a2, a3, a4);
+	}
+
+private:
+	void send(IlmpStream* stream, const A1& a1, const A2& a2, const A3& a3, const A4& a4) const {
+		std::string frame;
+		beginFrame(stream, frame, IlmpRpcParam<A1>::size(stream, pageviewId, a1) + IlmpRpcParam<A2>::size(stream, pageviewId, a2)
+				+ IlmpRpcParam<A3>::size(stream, pageviewId, a3) + IlmpRpcParam<A4>::size(stream, pageviewId, a4));
+		IlmpRpcParam<A1>::append(stream, pageviewId, frame, a1);
+		IlmpRpcParam<A2>::append(stream, pageviewId, frame, a2);
+		IlmpRpcParam<A3>::append(stream, pageviewId, frame, a3);
+		IlmpRpcParam<A4>::append(stream, pageviewId, frame, a4);
+		sendFrame(stream, frame);
+	}
+};
+
+#endif
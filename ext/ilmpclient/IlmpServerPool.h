@@ -0,0 +1,162 @@
+/*
+ * ILMP client library - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ILMPCLIENT_ILMP_SERVER_POOL_H
+#define ILMPCLIENT_ILMP_SERVER_POOL_H
+
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "TokenWalker.h"
+
+// Latency assumed for a server without measurements, in milliseconds. Low enough that
+// unknown servers get tried.
+#ifndef ILMP_POOL_DEFAULT_LATENCY
+#define ILMP_POOL_DEFAULT_LATENCY 200
+#endif
+
+// A server is degraded when another one has a weight this many times as high.
+#ifndef ILMP_POOL_DEGRADED_RATIO
+#define ILMP_POOL_DEGRADED_RATIO 4
+#endif
+
+// IlmpServerPool is a list of ILCS servers to pick from, with a health record for each:
+// moving averages of the connect latency, the ping round trip time and the rate of failed
+// connections. A server's weight is inversely proportional to its latency and falls with
+// its failure rate; pick() picks at random in proportion to the weights, so clients spread
+// over the servers and prefer the fast and reliable ones. degraded() tells when the server
+// in use does so much worse than another that sessions should move off it.
+class IlmpServerPool {
+public:
+	struct Server {
+		std::string host;
+		std::string port;
+		double latency; // Milliseconds; negative when not measured yet
+		double failureRate; // 0..1
+	};
+
+	IlmpServerPool() : alpha(0.3), seed(initialSeed()) {}
+
+	// Takes servers as "host:port", separated by commas.
+	explicit IlmpServerPool(const std::string& servers) : alpha(0.3), seed(initialSeed()) {
+		StringTokenWalker tokens(servers, ',');
+		std::string server;
+		while (tokens.tryNext(server)) {
+			size_t colon = server.rfind(':');
+			if (colon == std::string::npos) add(server, "80");
+			else add(server.substr(0, colon), server.substr(colon + 1));
+		}
+	}
+
+	void add(const std::string& host, const std::string& port) {
+		bool bracketed = host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']'; // IPv6 address
+		Server s = { bracketed ? host.substr(1, host.size() - 2) : host, port, -1, 0 };
+		servers.push_back(s);
+	}
+
+	size_t size() const { return servers.size(); }
+	const Server& operator[](size_t i) const { return servers[i]; }
+
+	// Picks a server at random, weighted by health, other than exclude when there is any
+	// other. Returns its index.
+	size_t pick(size_t exclude = (size_t)-1) {
+		double total = 0;
+		for (size_t i = 0; i < servers.size(); i++)
+			if (i != exclude) total += weight(i);
+		if (total <= 0)
+			return servers.size() > 1 && exclude == 0 ? 1 : 0;
+
+		double r = nextRandom() * total;
+		size_t last = 0;
+		for (size_t i = 0; i < servers.size(); i++) {
+			if (i == exclude) continue;
+			last = i;
+			r -= weight(i);
+			if (r < 0) break;
+		}
+		return last;
+	}
+
+	// Health updates of server i.
+	void connected(size_t i, int connectLatency) {
+		servers[i].failureRate *= 1 - alpha;
+		sample(i, connectLatency);
+	}
+
+	void failed(size_t i) {
+		servers[i].failureRate = servers[i].failureRate * (1 - alpha) + alpha;
+	}
+
+	void rtt(size_t i, int ms) {
+		sample(i, ms);
+	}
+
+	double weight(size_t i) const {
+		const Server& s = servers[i];
+		double latency = s.latency < 0 ? ILMP_POOL_DEFAULT_LATENCY : s.latency;
+		double health = 1 - s.failureRate;
+		return health * health / (latency + 10);
+	}
+
+	// Whether another server has a much higher weight than server i.
+	bool degraded(size_t i) const {
+		for (size_t j = 0; j < servers.size(); j++) {
+			if (j != i && weight(j) > weight(i) * ILMP_POOL_DEGRADED_RATIO)
+				return true;
+		}
+		return false;
+	}
+
+private:
+	std::vector<Server> servers;
+	double alpha; // Weight of a new sample in the moving averages
+	unsigned seed;
+
+	void sample(size_t i, int ms) {
+		Server& s = servers[i];
+		s.latency = s.latency < 0 ? ms : s.latency * (1 - alpha) + ms * alpha;
+	}
+
+	// Seeds differently per process and per pool, as clients started in the same second
+	// would otherwise all make the same picks.
+	unsigned initialSeed() const {
+		unsigned s = (unsigned)boost::posix_time::microsec_clock::universal_time().time_of_day().total_microseconds();
+		s ^= (unsigned)(size_t)this;
+#ifdef _WIN32
+		s ^= (unsigned)_getpid() << 16;
+#else
+		s ^= (unsigned)getpid() << 16;
+#endif
+		return s;
+	}
+
+	// Returns a number in [0, 1).
+	double nextRandom() {
+		seed = seed * 1103515245u + 12345u;
+		return (seed >> 8) / 16777216.0;
+	}
+};
+
+#endif
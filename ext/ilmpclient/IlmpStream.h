@@ -22,19 +22,42 @@
 #include <string>
 #include <iostream>
 #include <map>
+#include <vector>
+#include <new>
 
 #include <boost/asio.hpp>
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/pool/pool.hpp>
 
 #include "TokenWalker.h"
+#include "IlmpFrameParser.h"
+#include "IlmpCallbackRegistry.h"
+#include "IlmpHandlerAlloc.h"
+#include "IlmpReceiveBuffer.h"
+#include "IlmpJson.h"
+#include "IlmpConnector.h"
+#include "IlmpResolverCache.h"
 
 #define ILMP_VERSION "2.0"
 // This implementation is also compatible with 1.0 servers.
 
+// Time without receiving anything after which a ping is sent, and time to wait for any data
+// after it before the connection is taken to be lost, in seconds.
+#ifndef ILMP_PING_INTERVAL
 #define ILMP_PING_INTERVAL 60
+#endif
+#ifndef ILMP_PONG_TIMEOUT
+#define ILMP_PONG_TIMEOUT 20
+#endif
+
+// Largest frame accepted from the server, in bytes. Each stream keeps a receive buffer of
+// this size; a larger frame is a protocol error.
+#ifndef ILMP_MAX_FRAME_SIZE
+#define ILMP_MAX_FRAME_SIZE (256 * 1024)
+#endif
 
 using boost::asio::ip::tcp;
 
@@ -51,47 +74,71 @@ class IlmpCommand;
 // clean up any resources the callback logic might need.
 class IlmpCallback {
 	friend class IlmpCommand;
+	friend class IlmpStream;
+	friend class IlmpRpcBase;
 
 private:
-	// for each ptr in ptrs: *ptr == this
-	std::list<IlmpCallback**> ptrs;
+	// Node of the list of pointers that are reset when this callback is destructed. Nodes
+	// are allocated from the stream's pool.
+	struct WeakRef {
+		IlmpCallback** ptr;
+		WeakRef* next;
+	};
+	
+	// for each ref in refs: *ref->ptr == this
+	WeakRef* refs;
 
 public:
+	// Adds ptr to the pointers that are reset when this callback is destructed, and removes
+	// it again, e.g. when the pointer moves on to another callback.
+	void addWeakRef(IlmpCallback** ptr);
+	void removeWeakRef(IlmpCallback** ptr);
+
 	IlmpStream *stream; // Weak ref
 
 	int id; // cbid
 	int pageviewId; // pvid
 
-	IlmpCallback(IlmpStream* stream_, int pageviewId_) : stream(stream_), pageviewId(pageviewId_), id(0) {}
+	IlmpCallback(IlmpStream* stream_, int pageviewId_) : refs(0), stream(stream_), id(0), pageviewId(pageviewId_) {}
 
-	virtual void onData(StringTokenWalker& params) { }
+	virtual void onData(StringRefTokenWalker& params) { }
+
+	// Json data goes to the handler returned here, which is fed by parsing the data in the
+	// receive buffer. Without a handler, onJsonData gets a copy of the text instead.
+	virtual IlmpJsonHandler* jsonHandler() { return 0; }
 	virtual void onJsonData(const std::string& json) {
 		std::cerr << "ILMP: Ignoring json data: " << json << std::endl;
 	}
 
 	void cancel();
+
+	// Destructs and deallocates this callback. Callbacks that were not allocated with plain
+	// new override this to give their memory back where it came from.
+	virtual void destroy() { delete this; }
 	
-	virtual ~IlmpCallback() {
-#ifdef ILMPDEBUG
-		std::cout << "Destroying IlmpCallback(id=" << id << "), referenced at " << ptrs.size() << " places" << std::endl;
-#endif
-		for (std::list<IlmpCallback**>::iterator it = ptrs.begin(); it != ptrs.end(); it++) **it = 0;
-	}
+	virtual ~IlmpCallback();
 };
 
 // IlmpCallback wrapper for native function pointers expressed as boost::function. Ignores json data.
+// Instances are allocated from a pool owned by the stream through ::create.
 class IlmpCallbackNativeFunc : public IlmpCallback {
 public:
-	typedef boost::function<void(StringTokenWalker&)> NativeFunc;
+	typedef boost::function<void(StringRefTokenWalker&)> NativeFunc;
 
-	IlmpCallbackNativeFunc(IlmpStream* stream_, int pageviewId_, NativeFunc& func_) : IlmpCallback(stream_, pageviewId_), func(func_) {}
+	static IlmpCallbackNativeFunc* create(IlmpStream* stream_, int pageviewId_, const NativeFunc& func_);
 
-	void onData(StringTokenWalker& params) {
+	void onData(StringRefTokenWalker& params) {
 		func(params);
 	}
 
+	void destroy();
+
 private:
+	IlmpCallbackNativeFunc(IlmpStream* stream_, int pageviewId_, const NativeFunc& func_) : IlmpCallback(stream_, pageviewId_), func(func_) {}
+
 	NativeFunc func;
+		// Bound member functions fit boost::function's small object buffer, so the pool
+		// allocation is the only one made for a callback.
 };
 
 static int ids = 0;
@@ -107,6 +154,9 @@ static int ids = 0;
 class IlmpStream : boost::noncopyable, public boost::enable_shared_from_this<IlmpStream>
 {
 	friend class IlmpCommand;
+	friend class IlmpCallback;
+	friend class IlmpCallbackNativeFunc;
+	friend class IlmpRpcBase;
 
 private:
 	boost::asio::io_service& ioService; 
@@ -115,23 +165,72 @@ private:
 	const std::string port;
 	const std::string siteDir;
 
-	typedef std::pair<int, IlmpCallback*> CallbackPair;
-	typedef std::map<int, CallbackPair> CallbackMap;
-	typedef std::map<int, CallbackMap> PageviewMap;
-	PageviewMap callbacks;
+	// Memory for IlmpCallbackNativeFuncs and weak references to callbacks. Declared before
+	// callbacks, as destructing callbacks gives memory back to these pools.
+	boost::pool<> callbackPool;
+	boost::pool<> weakRefPool;
+
+	typedef IlmpCallbackRegistry<IlmpCallback> CallbackRegistry;
+	CallbackRegistry callbacks;
 		// pageviewId -> callbackId -> [refCount, callback]
-	
-	std::map<int, int> callbackAt;
-		// pageviewId -> callbackAt
 
 	bool pongWait;
+	boost::posix_time::ptime pingSent;
+	boost::posix_time::ptime lastReceived;
+	boost::posix_time::time_duration pingInterval;
+	boost::posix_time::time_duration pongTimeout;
+
+	boost::posix_time::ptime connectStarted;
+	int connectTime;
 
-	// In the current implementation, resolver, socket and pingTimer have a similar lifespan.
-	tcp::resolver* resolver;
+	// In the current implementation, connector, socket and pingTimer have a similar lifespan.
+	// The socket comes from the connector once connected.
+	boost::shared_ptr<IlmpConnector> connector;
 	tcp::socket* socket;
 	boost::asio::deadline_timer* pingTimer;
 
-	boost::asio::streambuf response;
+	// Recycled handler memory, one block per chain of operations that is outstanding at most
+	// once at a time, so the steady read/write/ping cycle does not allocate.
+	IlmpHandlerMemory readMemory;
+	IlmpHandlerMemory writeMemory;
+	IlmpHandlerMemory pingMemory;
+
+	IlmpReceiveBuffer response;
+	size_t maxFrameSize;
+	int connectionId; // Changes with every connect, so reads and writes can tell whether they are stale
+
+	tcp::endpoint preferredEndpoint; // Tried first when it is among the resolved endpoints
+
+	// Outgoing frames. At most one async_write is in flight at any time; frames written in
+	// the meantime are queued in writeQueue and sent together in a single gather write once
+	// the current one completes, so frame order is preserved and bursts share a syscall.
+	std::vector<std::string> writeQueue;
+	std::vector<std::string> writeBufs; // Frames of the write in flight
+	std::vector<boost::asio::const_buffer> writeIov;
+	bool writing;
+
+	// The buffers of a write in flight when its connection was closed, by connection id. The
+	// write may still read them until its handler runs, which releases them.
+	struct AbandonedWrite {
+		std::vector<std::string> bufs;
+		std::vector<boost::asio::const_buffer> iov;
+	};
+	std::map<int, AbandonedWrite> abandonedWrites;
+	bool corked; // While set, frames are queued but not written
+
+	// Frame buffers that have been written, kept with their capacity so IlmpCommands can
+	// serialize into them without allocating.
+	std::vector<std::string> framePool;
+
+	// Serialized "pageviewId\002Msite|rpc" prefixes of recently sent commands.
+	struct FramePrefix {
+		int pageviewId;
+		std::string site;
+		std::string rpc;
+		std::string prefix;
+	};
+	std::vector<FramePrefix> prefixCache;
+	size_t prefixCacheNext;
 
 	int protocolVersion;
 	int respSeq;
@@ -144,36 +243,73 @@ public:
 	boost::function<void()> onReady;
 	boost::function<void(int,const std::string&)> onError;
 
+	// Invoked around the callbacks that are run for the frames of a single read, so the
+	// receiving side can apply the updates they make in one go.
+	boost::function<void()> onBatchBegin;
+	boost::function<void()> onBatchEnd;
+
+	// Invoked with the round trip time of each ping, in milliseconds.
+	boost::function<void(int)> onRtt;
+
 	int id; // used for debugging
 
 	IlmpStream(boost::asio::io_service& ioService, const std::string& _host, const std::string& _port = "80", const std::string& _siteDir = "") :
-			host(_host), port(_port), ioService(ioService), siteDir(_siteDir == "" ? _host : _siteDir), wasConnected(false), pongWait(false), respSeq(0),
-			resolver(0), socket(0), pingTimer(0), protocolVersion(0) {
+			ioService(ioService), host(_host), port(_port), siteDir(_siteDir == "" ? _host : _siteDir),
+			callbackPool(sizeof(IlmpCallbackNativeFunc)), weakRefPool(sizeof(IlmpCallback::WeakRef)), pongWait(false),
+			pingInterval(boost::posix_time::seconds(ILMP_PING_INTERVAL)), pongTimeout(boost::posix_time::seconds(ILMP_PONG_TIMEOUT)), connectTime(0),
+			socket(0), pingTimer(0), maxFrameSize(ILMP_MAX_FRAME_SIZE), connectionId(0), writing(false), corked(false),
+			prefixCacheNext(0), protocolVersion(0), respSeq(0), wasConnected(false), retryAfter(0) {
 		static int ids = 0;
 		id = ids++;
 	}
 
+	// Sets the largest frame accepted from the server; takes effect on the next connect.
+	void setMaxFrameSize(size_t size) {
+		maxFrameSize = size;
+	}
+
+	// Sets the keepalive timing, in seconds (see ILMP_PING_INTERVAL); takes effect on the next
+	// connect.
+	void setKeepalive(int interval, int timeout) {
+		pingInterval = boost::posix_time::seconds(interval);
+		pongTimeout = boost::posix_time::seconds(timeout);
+	}
+
+	// Sets an endpoint of host to try before the others, e.g. the one last connected to, so
+	// a client keeps coming back to the same server.
+	void setPreferredEndpoint(const tcp::endpoint& endpoint) {
+		preferredEndpoint = endpoint;
+	}
+
+	// Returns the time the last connect took from the addresses being known, in milliseconds.
+	int connectLatency() const {
+		return connectTime;
+	}
+
+	// Returns the endpoint connected to, or an unspecified endpoint when not connected.
+	tcp::endpoint remoteEndpoint() const {
+		boost::system::error_code err;
+		return socket ? socket->remote_endpoint(err) : tcp::endpoint();
+	}
+
 	void connect()
 	{
 		close();
+		connectionId++;
 
-		resolver = new tcp::resolver(ioService);
-		socket = new tcp::socket(ioService);
 		pingTimer = new boost::asio::deadline_timer(ioService);
 
 #ifdef ILMPDEBUG
 		std::cout << id << ": Connecting to " << host << " port " << port << "\n";
 #endif
-		tcp::resolver::query query(host, port);
-		resolver->async_resolve(query, boost::bind(&IlmpStream::onResolve, this->sharedPtr(),
-				boost::asio::placeholders::error, boost::asio::placeholders::iterator)); 
+		IlmpResolverCache::instance().resolve(ioService, host, port, boost::bind(&IlmpStream::onResolve, this->sharedPtr(),
+				_1, _2, connectionId));
 	}
 
 	void close() {
-		if (resolver) {
-			resolver->cancel();
-			delete resolver;
-			resolver = 0;
+		if (connector) {
+			connector->cancel();
+			connector.reset();
 		}
 		if (socket) {
 			socket->close();
@@ -189,18 +325,27 @@ public:
 			pingTimer = 0;
 		}
 
-		int i = 0;
-		for (PageviewMap::iterator it = callbacks.begin(); it != callbacks.end(); it++) {
-			for (CallbackMap::iterator it2 = (it->second).begin(); it2 != (it->second).end(); it2++) {
-				delete (it2->second).second;
-				i++;
-			}
+		writeQueue.clear();
+		if (writing) {
+			AbandonedWrite& w = abandonedWrites[connectionId];
+			w.bufs.swap(writeBufs);
+			w.iov.swap(writeIov);
 		}
-		callbacks.clear();
-		callbackAt.clear();
+		writeBufs.clear();
+		writeIov.clear();
+		writing = false;
+		corked = false;
+
 #ifdef ILMPDEBUG
+		int i = callbacks.clear();
 		if (i > 0) std::cout << id << ": Deregistered " << i << " callbacks\n";
+#else
+		callbacks.clear();
 #endif
+
+		// All callbacks are gone; release their pools in bulk.
+		callbackPool.purge_memory();
+		weakRefPool.purge_memory();
 	}
 
 #ifdef ILMPDEBUG
@@ -225,12 +370,7 @@ public:
 	// Dumps callbacks structure in readable format to std::cout.
 	void debugCallbacks() const {
 		std::cout << "\n----- CALLBACKS -----\n";
-		for (PageviewMap::const_iterator i = callbacks.begin(); i != callbacks.end(); i++) {
-			std::cout << "  pageviewId=" << (i->first) << ":\n";
-			for (CallbackMap::const_iterator j = (i->second).begin(); j != (i->second).end(); j++) {
-				std::cout << "    cbId=" << (j->first) << ", refCnt=" << (j->second).first << "\n";
-			}
-		}
+		callbacks.debugPrint(std::cout);
 		std::cout << "------- (end) -------\n\n";
 	}
 #endif
@@ -238,62 +378,146 @@ public:
 	// We take responsibility of destructing the IlmbCallback reference when the callback is no longer needed.
 	int registerCallback(IlmpCallback* cb)
 	{
-		if (!cb->id)
-			// Following js-implementation, just increment, starting at 1.
-			cb->id = ++callbackAt[cb->pageviewId];
-		
-		callbacks[cb->pageviewId][cb->id] = CallbackPair(1, cb);
-		return cb->id;
+		return callbacks.add(cb);
+	}
+
+	// Returns the id registerCallback assigns to the next callback of pageviewId.
+	int nextCallbackId(int pageviewId)
+	{
+		return callbacks.nextId(pageviewId);
 	}
 
 	void cancelCallback(IlmpCallback* cb)
 	{
-		std::stringstream cmd;
-		cmd << cb->pageviewId << '\002' << "C" << cb->id << '\001';
-		write(cmd.str());
+		std::string cmd; acquireFrame(cmd);
+		appendInt(cmd, cb->pageviewId);
+		cmd.append("\002C", 2);
+		appendInt(cmd, cb->id);
+		cmd.push_back('\001');
+		writeFrame(cmd);
 		
-		delete callbacks[cb->pageviewId][cb->id].second;
-		callbacks[cb->pageviewId].erase(cb->id);
+		callbacks.remove(cb->pageviewId, cb->id);
 	}
 
 	bool wasConnected;
+	int retryAfter; // Seconds the server asked to wait before connecting again, with the 'U'; 0 if not
 
 private:
 	void write(const std::string& data)
+	{
+		std::string frame; acquireFrame(frame);
+		frame.assign(data);
+		writeFrame(frame);
+	}
+
+	// Queues frame for writing, taking over its buffer; frame is left empty.
+	void writeFrame(std::string& frame)
 	{
 #ifdef ILMPDEBUG
-		std::cout << " [ilmp:" << id << "] >> " << readable(data) << std::endl;
+		std::cout << " [ilmp:" << id << "] >> " << readable(frame) << std::endl;
 #endif
 
-		if (!socket || !socket->is_open())
+		if (!socket || !socket->is_open()) {
+			recycleFrame(frame);
 			return;
+		}
 		
-		std::string* _data = new std::string(data);
+		writeQueue.push_back(std::string());
+		writeQueue.back().swap(frame);
 
-		boost::asio::async_write(*socket, boost::asio::buffer(*_data),
-				boost::bind(&IlmpStream::onWritten, this->sharedPtr(), _data, boost::asio::placeholders::error));
+		if (!writing && !corked)
+			flush();
 	}
 
-	void onWritten(std::string* dataBuf, const boost::system::error_code& err)
+	// Swaps an empty, pooled buffer into frame.
+	void acquireFrame(std::string& frame)
 	{
-		delete dataBuf;
+		if (framePool.empty())
+			return;
+		frame.swap(framePool.back());
+		framePool.pop_back();
+	}
+
+	// Returns the buffer of frame to the pool, unless the pool is full or the buffer got too
+	// large to be worth keeping around.
+	void recycleFrame(std::string& frame)
+	{
+		if (framePool.size() >= 16 || frame.capacity() > 64*1024)
+			return;
+		framePool.push_back(std::string());
+		framePool.back().swap(frame);
+		framePool.back().clear();
+	}
+
+	// Returns the "pageviewId\002Msite|rpc" prefix of a command frame, serializing it only
+	// when it is not one of the recently used ones.
+	const std::string& framePrefix(int pageviewId, const StringRef& site, const StringRef& rpc)
+	{
+		for (std::vector<FramePrefix>::iterator it = prefixCache.begin(); it != prefixCache.end(); it++) {
+			if (it->pageviewId == pageviewId && StringRef(it->rpc) == rpc && StringRef(it->site) == site)
+				return it->prefix;
+		}
+
+		if (prefixCache.size() < 16)
+			prefixCache.push_back(FramePrefix());
+		FramePrefix& p = prefixCache[prefixCacheNext++ % prefixCache.size()];
 		
-		if (!socket || err == boost::asio::error::operation_aborted)
+		p.pageviewId = pageviewId;
+		p.site.assign(site.begin(), site.end());
+		p.rpc.assign(rpc.begin(), rpc.end());
+		p.prefix.clear();
+		appendInt(p.prefix, pageviewId);
+		p.prefix.append("\002M", 2);
+		p.prefix.append(p.site);
+		p.prefix.push_back('|');
+		p.prefix.append(p.rpc);
+		return p.prefix;
+	}
+
+	// Sends all queued frames in one gather write.
+	void flush()
+	{
+		writeBufs.swap(writeQueue);
+		
+		writeIov.clear();
+		for (std::vector<std::string>::const_iterator it = writeBufs.begin(); it != writeBufs.end(); it++)
+			writeIov.push_back(boost::asio::buffer(*it));
+		
+		writing = true;
+		boost::asio::async_write(*socket, buffersRef(writeIov),
+				makeAllocHandler(writeMemory, boost::bind(&IlmpStream::onWritten, this->sharedPtr(), boost::asio::placeholders::error, connectionId)));
+	}
+
+	void onWritten(const boost::system::error_code& err, int writeConnectionId)
+	{
+		if (!abandonedWrites.empty() && abandonedWrites.erase(writeConnectionId))
+			return; // Of a closed connection
+		if (!socket || writeConnectionId != connectionId || err == boost::asio::error::operation_aborted)
 			return;
-		else if (err) {
+		
+		writing = false;
+		for (std::vector<std::string>::iterator it = writeBufs.begin(); it != writeBufs.end(); it++)
+			recycleFrame(*it);
+		writeBufs.clear();
+		
+		if (err) {
 			std::stringstream msg; msg << "Error while writing: " << err.message();
 			handleError(ILMPERR_NETWORK, msg.str());
 			return;
 		}
+
+		if (!writeQueue.empty())
+			flush();
 	}
 	
-	void onResolve(const boost::system::error_code& err, tcp::resolver::iterator endpoint_itr)
+	void onResolve(const boost::system::error_code& err, const IlmpResolverCache::Endpoints& endpoints, int resolveConnectionId)
 	{
 #ifdef ILMPDEBUG
 		std::cout << id << ": onResolve" << std::endl;
 #endif
 	
-		if (!resolver || err == boost::asio::error::operation_aborted)
+		// The shared resolve cannot be cancelled; drop its result once closed or reconnected.
+		if (!pingTimer || resolveConnectionId != connectionId || err == boost::asio::error::operation_aborted)
 			return;
 		else if (err) {
 			std::stringstream msg; msg << "Unable to resolve hostname " << host << ": " << err.message();
@@ -301,120 +525,135 @@ private:
 			return;
 		}
 		
-		tcp::endpoint endpoint = *endpoint_itr;
-		socket->async_connect(endpoint, boost::bind(&IlmpStream::onConnect, this->sharedPtr(),
-				boost::asio::placeholders::error, ++endpoint_itr)); 
+		// Without a preferred endpoint, return to the one this process last connected to.
+		tcp::endpoint preferred(preferredEndpoint.port() ? preferredEndpoint : IlmpResolverCache::instance().good(host, port));
+		connectStarted = boost::posix_time::microsec_clock::universal_time();
+		connector.reset(new IlmpConnector(ioService));
+		connector->connect(endpoints, preferred, boost::bind(&IlmpStream::onConnect, this->sharedPtr(), _1, _2));
 	}
 	
-	void onConnect(const boost::system::error_code& err, tcp::resolver::iterator endpoint_itr)
+	void onConnect(const boost::system::error_code& err, tcp::socket* connectedSocket)
 	{
 #ifdef ILMPDEBUG
 		std::cout << id << ": onConnect" << std::endl;
 #endif
-		if (!socket || err == boost::asio::error::operation_aborted)
-			return;
-		else if (err && endpoint_itr != tcp::resolver::iterator()) {
-			// Connection failed, but we can try the next endpoint.
-			socket->close();
-			tcp::endpoint endpoint = *endpoint_itr;
-			std::cout << "Unable to connect to '" << endpoint << "'; trying next endpoint\n";
-			socket->async_connect(endpoint, boost::bind(&IlmpStream::onConnect, this->sharedPtr(),
-					boost::asio::placeholders::error, ++endpoint_itr));
-			return;
-		}
-		else if (err) {
+		connector.reset();
+		if (err) {
 			std::cout << "Unable to connect to " << host << ":" << port << ": " << err.message();
 			handleError(ILMPERR_NETWORK, err.message());
 			return;
 		}
 
+		socket = connectedSocket;
 		wasConnected = true;
+		connectTime = (boost::posix_time::microsec_clock::universal_time() - connectStarted).total_milliseconds();
+		IlmpResolverCache::instance().setGood(host, port, remoteEndpoint());
 
 		// Connected
 		
-		// Send post-connect gallantry
-		std::string* req = new std::string("GET /ilcs? ILMP/" ILMP_VERSION "\n\n");
-		boost::asio::async_write(*socket, boost::asio::buffer(*req),
-				boost::bind(&IlmpStream::onWritten, this->sharedPtr(), req, boost::asio::placeholders::error));
-
-		// Setup read callback
-		boost::asio::async_read_until(*socket, response, '\001', boost::bind(&IlmpStream::onData,
-				this->sharedPtr(), boost::asio::placeholders::error));
+		// Send post-connect gallantry. The frames sent from onReady go out in the same write,
+		// so a client can log in within the first round trip.
+		corked = true;
+		write("GET /ilcs? ILMP/" ILMP_VERSION "\n\n");
+
+		// Setup read callback. The buffer is reset here rather than in connect, which may be
+		// called from a callback while frames in the buffer are being walked.
+		response.reset(maxFrameSize);
+		read();
 	
 		// Schedule ping timer
-		pingTimer->expires_from_now(boost::posix_time::seconds(ILMP_PING_INTERVAL));
-		pingTimer->async_wait(boost::bind(&IlmpStream::onPingTimer,
-				this->sharedPtr(), boost::asio::placeholders::error));
+		pongWait = false;
+		lastReceived = boost::posix_time::microsec_clock::universal_time();
+		schedulePing(lastReceived + pingInterval);
 
 		if (onReady) onReady(); //ioService.post(onReady);
+
+		corked = false;
+		if (socket && !writing && !writeQueue.empty())
+			flush();
 	}
 
 
-	CallbackPair *getCallback(int pageviewId, int callbackId, bool remove = false)
+	CallbackRegistry::Entry *getCallback(int pageviewId, int callbackId)
 	{
-		PageviewMap::iterator pvPtr = callbacks.find(pageviewId);
-
-		if (pvPtr == callbacks.end()) {
-			std::cerr << "Ignoring unknown pageview " << pageviewId << std::endl;
-			return 0;
-		}
-
-		CallbackMap& pvCallbacks = pvPtr->second;
-			// Obtain value from key-value pair
-		
-		CallbackMap::iterator cbPtr = pvCallbacks.find(callbackId);
-		
-		if (cbPtr == pvCallbacks.end()) {
+		CallbackRegistry::Entry *e = callbacks.find(pageviewId, callbackId);
+		if (!e)
 			std::cerr << "Ignoring unknown callback " << callbackId << " for pageview " << pageviewId << std::endl;
-			return 0;
-		}
+		return e;
+	}
 
-		CallbackPair *cbp = &cbPtr->second;
 
-		if (remove) {
-			delete cbp->second;
-			pvCallbacks.erase(callbackId);
-			if (pvCallbacks.empty())
-				callbacks.erase(pageviewId);
+	// Calls onBatchBegin on construction and onBatchEnd on destruction.
+	class BatchScope : boost::noncopyable {
+	public:
+		BatchScope(IlmpStream& stream_) : stream(stream_) {
+			if (stream.onBatchBegin) stream.onBatchBegin();
 		}
+		~BatchScope() {
+			if (stream.onBatchEnd) stream.onBatchEnd();
+		}
+	private:
+		IlmpStream& stream;
+	};
 
-		return cbp;
-	}
-
-
-	void runCallback(IlmpCallback *c, std::string message)
+	// message points into the receive buffer, which is unescaped in place.
+	void runCallback(IlmpCallback *c, const StringRef& message)
 	{
-		if (message.size() > 0 && message.at(0) == '\005') {
-			// In the future, and when used extensively on larger json sets, we
-			// might want to prevent the .substr() here.
-			c->onJsonData(message.substr(1));
+		if (message.size() > 0 && message[0] == '\005') {
+			char* first = const_cast<char*>(message.begin()) + 1;
+			char* last = IlmpCodec::unescapeInPlace(first, first + message.size() - 1);
+			if (IlmpJsonHandler* handler = c->jsonHandler()) {
+				if (!IlmpJsonParser::parse(first, last, *handler))
+					std::cerr << "ILMP: Malformed json data for callback " << c->id << std::endl;
+			}
+			else
+				c->onJsonData(std::string(first, last));
 		}
 		else {
-			StringTokenWalker params(message, '\004', true);
+			// Params are split before they are unescaped, as a \004 within a param is escaped.
+			StringRefTokenWalker params(message, '\004', true, true);
 			c->onData(params);
 		}
 	}
 
 
-	void onData(const boost::system::error_code& err)
+	void read()
 	{
-		if (!socket || err == boost::asio::error::operation_aborted)
+		boost::asio::mutable_buffers_1 space = response.prepare();
+		if (boost::asio::buffer_size(space) == 0) {
+			std::stringstream msg;
+			msg << "Frame exceeds maximum size of " << response.capacity() << " bytes";
+			handleError(ILMPERR_PROTOCOL, msg.str());
+			return;
+		}
+		socket->async_read_some(space, makeAllocHandler(readMemory, boost::bind(&IlmpStream::onData,
+				this->sharedPtr(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, connectionId)));
+	}
+
+	void onData(const boost::system::error_code& err, size_t bytesTransferred, int readConnectionId)
+	{
+		if (!socket || readConnectionId != connectionId || err == boost::asio::error::operation_aborted)
 			return;
 		else if (err) {
 			handleError(ILMPERR_NETWORK, "Error while reading data");
 			return;
 		}
+		response.commit(bytesTransferred);
+		lastReceived = boost::posix_time::microsec_clock::universal_time(); // Proof of life; puts off the next ping
 
-		StreamTokenWalker commands(response, '\001');
-		for (std::string command; commands.tryNext(command);) {
+		// Walk all complete frames in place; a trailing partial frame stays in the buffer.
+		const char* data = response.data();
+		IlmpFrameParser frames(data, data + response.size());
+		BatchScope batch(*this);
+		for (StringRef frame; frames.next(frame);) {
 
 #ifdef ILMPDEBUG
-			std::cout << " [ilmp:" << id << "] << " << readable(command) << "\n";
+			std::cout << " [ilmp:" << id << "] << " << readable(frame.str()) << "\n";
 #endif
 			
-			StringTokenWalker tokens(command, '\002', true);
+			StringRefTokenWalker tokens(frame, '\002', true);
 
-			tokens.next(command);
+			StringRef command; tokens.next(command);
 
 			if (protocolVersion < 2) {
 				if (command == "ILMP") { // protocol upgrade
@@ -423,7 +662,7 @@ private:
 				}
 				// We're ILMP version 1 which means that 'command' is actually
 				// the resp id.
-				if (atoi(command.c_str()) != ++respSeq) {
+				if (toInt(command) != ++respSeq) {
 					handleError(ILMPERR_PROTOCOL, "Response id sequence mismatch");
 					return;
 				}
@@ -432,6 +671,8 @@ private:
 			}
 
 			if (command == "P") {
+				if (pongWait && onRtt)
+					onRtt((lastReceived - pingSent).total_milliseconds());
 				pongWait = false;
 				continue;
 			}
@@ -439,54 +680,62 @@ private:
 			if (command == "U") {
 				// We need to update.
 				std::cout << "Server instructed to update the client" << std::endl;
-				std::string updateUrl; tokens.tryNext(updateUrl, "");
-				handleError(ILMPERR_PROTOVER, updateUrl);
+				StringRef updateUrl; tokens.tryNext(updateUrl);
+				tokens.tryNext(retryAfter);
+				handleError(ILMPERR_PROTOVER, updateUrl.str());
 				return;
 			}
 			
 			if (protocolVersion >= 2) {
 				if (command[0]=='m') {
-					int pageviewId = atoi(command.substr(1).c_str());
+					int pageviewId = toInt(command.substr(1));
 					for (int callbackId; tokens.tryNext(callbackId);) {
-						std::string message; tokens.next(message);
+						StringRef message; tokens.next(message);
 						if (callbackId == -3 || callbackId == -4) { // it's a incr/decr refcnt callback
-							int aboutCallbackId = atoi(message.c_str());
-							CallbackPair *cbp = getCallback(pageviewId, aboutCallbackId);
+							int aboutCallbackId = toInt(message);
+							CallbackRegistry::Entry *cbp = getCallback(pageviewId, aboutCallbackId);
 							if (cbp) {
 								if (callbackId == -3)
-									cbp->first++;
-								else if (--cbp->first <= 0)
-									getCallback(pageviewId, aboutCallbackId, true); // remove
+									cbp->refCount++;
+								else if (--cbp->refCount <= 0)
+									callbacks.remove(pageviewId, aboutCallbackId);
 							}
 						}
 						else {
-							CallbackPair *cbp = getCallback(pageviewId, callbackId);
+							CallbackRegistry::Entry *cbp = getCallback(pageviewId, callbackId);
 							if (cbp)
-								runCallback(cbp->second, message);
+								runCallback(cbp->cb, message);
 						}
 					}
 				}
 				// else {}; // reserved for future use
 			}
 			else {
-				int pageviewId = atoi(command.c_str());
+				int pageviewId = toInt(command);
 				int callbackId; tokens.next(callbackId);
-				std::string refUpdate; tokens.next(refUpdate);
+				StringRef refUpdate; tokens.next(refUpdate);
 				
-				CallbackPair *cbp = getCallback(pageviewId, callbackId);
+				CallbackRegistry::Entry *cbp = getCallback(pageviewId, callbackId);
 				if (cbp) {
-					for (std::string message; tokens.tryNext(message, "");)
-						runCallback(cbp->second, message);
-					if (refUpdate.size()) {
-						cbp->first += (refUpdate=="-" ? -1 : (refUpdate=="+" ? 1 : atoi(refUpdate.c_str())));
-						if (cbp->first <= 0)
-							getCallback(pageviewId, callbackId, true); // remove the callback
+					for (StringRef message; cbp && tokens.tryNext(message);) {
+						runCallback(cbp->cb, message);
+						cbp = callbacks.find(pageviewId, callbackId); // The callback may have (de)registered callbacks
+					}
+					if (cbp && refUpdate.size()) {
+						cbp->refCount += (refUpdate=="-" ? -1 : (refUpdate=="+" ? 1 : toInt(refUpdate)));
+						if (cbp->refCount <= 0)
+							callbacks.remove(pageviewId, callbackId); // remove the callback
 					}
 				}
 			}
 		}
 
-		boost::asio::async_read_until(*socket, response, '\001', boost::bind(&IlmpStream::onData, this->sharedPtr(), boost::asio::placeholders::error));
+		if (!socket || readConnectionId != connectionId)
+			return; // Closed or reconnected by one of the callbacks
+		
+		response.consume(frames.consumed());
+
+		read();
 	}
 	
 	void onPingTimer(const boost::system::error_code& err) {
@@ -503,17 +752,33 @@ private:
 			return;
 		}
 
-		if (pongWait) {
-			// We were still waiting on a pong for the previous ping.
-			handleError(ILMPERR_NETWORK, "Ping/pong timeout");
+		// Anything received counts as a pong: a busy stream sends no pings, and an idle one
+		// one per interval. The timer is not moved with every read, but checks when it fires.
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+		if (pongWait && lastReceived < pingSent) {
+			if (now >= pingSent + pongTimeout) {
+				// Nothing received since the ping.
+				handleError(ILMPERR_NETWORK, "Ping/pong timeout");
+				return;
+			}
+			schedulePing(pingSent + pongTimeout);
+			return;
+		}
+		if (now < lastReceived + pingInterval) {
+			schedulePing(lastReceived + pingInterval);
 			return;
 		}
 
 		write("P\001");
 		pongWait = true;
+		pingSent = now;
+		schedulePing(now + pongTimeout);
+	}
 
-		pingTimer->expires_from_now(boost::posix_time::seconds(ILMP_PING_INTERVAL));
-		pingTimer->async_wait(boost::bind(&IlmpStream::onPingTimer, this->sharedPtr(), boost::asio::placeholders::error));
+	void schedulePing(const boost::posix_time::ptime& time) {
+		pingTimer->expires_at(time);
+		pingTimer->async_wait(makeAllocHandler(pingMemory, boost::bind(&IlmpStream::onPingTimer,
+				this->sharedPtr(), boost::asio::placeholders::error)));
 	}
 
 	void handleError(int e, const std::string& str) {
@@ -527,46 +792,106 @@ void IlmpCallback::cancel() {
 	stream->cancelCallback(this);
 }
 
+void IlmpCallback::addWeakRef(IlmpCallback** ptr) {
+	WeakRef* ref = static_cast<WeakRef*>(stream->weakRefPool.malloc());
+	if (!ref) throw std::bad_alloc();
+	ref->ptr = ptr;
+	ref->next = refs;
+	refs = ref;
+}
+
+void IlmpCallback::removeWeakRef(IlmpCallback** ptr) {
+	for (WeakRef** ref = &refs; *ref; ref = &(*ref)->next) {
+		if ((*ref)->ptr == ptr) {
+			WeakRef* r = *ref;
+			*ref = r->next;
+			stream->weakRefPool.free(r);
+			return;
+		}
+	}
+}
+
+IlmpCallback::~IlmpCallback() {
+#ifdef ILMPDEBUG
+	int n = 0;
+	for (WeakRef* ref = refs; ref; ref = ref->next) n++;
+	std::cout << "Destroying IlmpCallback(id=" << id << "), referenced at " << n << " places" << std::endl;
+#endif
+	while (refs) {
+		WeakRef* ref = refs;
+		refs = ref->next;
+		*ref->ptr = 0;
+		stream->weakRefPool.free(ref);
+	}
+}
+
+IlmpCallbackNativeFunc* IlmpCallbackNativeFunc::create(IlmpStream* stream_, int pageviewId_, const NativeFunc& func_) {
+	void* mem = stream_->callbackPool.malloc();
+	if (!mem) throw std::bad_alloc();
+	try {
+		return new (mem) IlmpCallbackNativeFunc(stream_, pageviewId_, func_);
+	}
+	catch (...) {
+		stream_->callbackPool.free(mem);
+		throw;
+	}
+}
+
+void IlmpCallbackNativeFunc::destroy() {
+	IlmpStream* s = stream;
+	this->~IlmpCallbackNativeFunc();
+	s->callbackPool.free(this);
+}
+
 // JsonString is a string specialization that, when fed to IlmpCommand, is send as json. 
 struct JsonString : public std::string {};
 
-// IlmpCommand 
+// IlmpCommand serializes a single command straight into a frame buffer borrowed from the
+// stream's pool; send() hands that buffer to the stream's write queue without copying.
 class IlmpCommand : boost::noncopyable 
 {
 private:
 	IlmpStream* stream;
 	int pageviewId;
-	std::stringstream cmd;
+	std::string cmd;
+	bool sent;
 
 public:
-	IlmpCommand(IlmpStream* _stream, const std::string& _cmd, int _pageviewId = 1, const std::string& siteDir = "") :
-		stream(_stream), pageviewId(_pageviewId), lastCb(0)
+	IlmpCommand(IlmpStream* _stream, const StringRef& _cmd, int _pageviewId = 1, const StringRef& siteDir = StringRef()) :
+		stream(_stream), pageviewId(_pageviewId), sent(false), lastCb(0)
 	{
-		cmd << pageviewId << '\002' << "M" << (siteDir == "" ? stream->siteDir : siteDir) << "|" << _cmd; 
+		stream->acquireFrame(cmd);
+		cmd.append(stream->framePrefix(pageviewId, siteDir.empty() ? StringRef(stream->siteDir) : siteDir, _cmd));
+	}
+
+	~IlmpCommand()
+	{
+		if (!sent) stream->recycleFrame(cmd);
 	}
 	
 	IlmpCommand& operator<<(int n) {
-		cmd << '\003' << "j" << n;
+		cmd.append("\003j", 2);
+		appendInt(cmd, n);
 		return *this;
 	}
 
 	IlmpCommand& operator<<(const JsonString& e) {
-		std::string c(e);
-		cmd << '\003' << "j" << escape(c);
+		cmd.append("\003j", 2);
+		IlmpCodec::appendEscaped(cmd, e);
 		return *this;
 	}
 
 	IlmpCommand& operator<<(const std::string& s) {
-		std::string c(s);
-		cmd << '\003' << "p" << escape(c);
+		cmd.append("\003p", 2);
+		IlmpCodec::appendEscaped(cmd, s);
 		return *this;
 	}
 	
 	// Convenience for operator<<(IlmpCallback*) that accepts a boost::function to be wrapped
 	// in a IlmpCallbackNativeFunc.
-	IlmpCommand& operator<<(boost::function<void(StringTokenWalker&) > cb)
+	IlmpCommand& operator<<(IlmpCallbackNativeFunc::NativeFunc cb)
 	{
-		return operator<<(new IlmpCallbackNativeFunc(stream, pageviewId, cb));
+		return operator<<(IlmpCallbackNativeFunc::create(stream, pageviewId, cb));
 	}
 
 	IlmpCallback *lastCb;
@@ -577,7 +902,7 @@ public:
 	{
 		if (lastCb) {
 			*cbPtr = lastCb;
-			lastCb->ptrs.push_back(cbPtr);
+			lastCb->addWeakRef(cbPtr);
 		}
 		return *this;
 	}
@@ -587,7 +912,8 @@ public:
 	IlmpCommand& operator<<(IlmpCallback* c)
 	{
 		stream->registerCallback(c);
-		cmd << '\003' << "c" << c->id;
+		cmd.append("\003c", 2);
+		appendInt(cmd, c->id);
 		lastCb = c;
 
 		return *this;
@@ -596,21 +922,9 @@ public:
 	// This IlmpCommand object should not be used after send().
 	void send()
 	{
-		cmd << '\001';
-		stream->write(cmd.str());
-	}
-
-private:
-	// Replaces \x00..\x05 with {\x05 [ascii representation of 0..5]}.
-	std::string escape(std::string& s) {
-		for (int i = 0; i < s.size(); i++) {
-			if (s[i] >= '\x00' && s[i] <= '\x05') {
-				char r[] = {'\x05', (char)(48+s[i])};
-				s.replace(i, 1, r, 2);
-				i++;
-			}
-		}
-		return s;
+		cmd.push_back('\001');
+		sent = true;
+		stream->writeFrame(cmd);
 	}
 };
 
@@ -19,10 +19,118 @@
 #ifndef ILMPCLIENT_TOKEN_WALKER_H
 #define ILMPCLIENT_TOKEN_WALKER_H
 
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <climits>
+#include <cctype>
+
 #include <boost/tokenizer.hpp>
 
+#include "IlmpCodec.h"
+
 struct TokenExpectedException { };
 
+// StringRef is a non-owning reference to a range of chars, typically pointing into a
+// receive buffer. It is only valid as long as the memory it refers to.
+class StringRef {
+public:
+	StringRef() : first(0), last(0) {}
+	StringRef(const char* begin_, const char* end_) : first(begin_), last(end_) {}
+	StringRef(const std::string& s) : first(s.data()), last(s.data() + s.size()) {}
+	StringRef(const char* s) : first(s), last(s + strlen(s)) {}
+
+	const char* begin() const { return first; }
+	const char* end() const { return last; }
+	const char* data() const { return first; }
+	size_t size() const { return last - first; }
+	bool empty() const { return first == last; }
+	char operator[](size_t i) const { return first[i]; }
+
+	std::string str() const { return std::string(first, last); }
+
+	StringRef substr(size_t pos) const { return StringRef(first + std::min(pos, size()), last); }
+
+	bool operator==(const char* s) const {
+		size_t n = strlen(s);
+		return n == size() && memcmp(first, s, n) == 0;
+	}
+	bool operator!=(const char* s) const { return !(*this == s); }
+	bool operator==(const StringRef& s) const {
+		return s.size() == size() && memcmp(first, s.first, size()) == 0;
+	}
+	bool operator!=(const StringRef& s) const { return !(*this == s); }
+
+private:
+	const char* first;
+	const char* last;
+};
+
+// Parses a decimal integer at the start of [first, last) in the manner of std::from_chars:
+// an optional '-' followed by digits, nothing else. Returns a pointer past the last digit,
+// or first when there are no digits or the number does not fit an int; value is only
+// assigned on success.
+inline const char* parseInt(const char* first, const char* last, int& value)
+{
+	const char* p = first;
+	bool neg = (p != last && *p == '-');
+	if (neg) p++;
+
+	const unsigned int limit = neg ? 0u - (unsigned int)INT_MIN : (unsigned int)INT_MAX;
+	unsigned int n = 0;
+	const char* digits = p;
+	for (; p != last && *p >= '0' && *p <= '9'; p++) {
+		unsigned int d = *p - '0';
+		if (n > (limit - d) / 10)
+			return first; // Out of range
+		n = n * 10 + d;
+	}
+	if (p == digits)
+		return first;
+
+	value = neg ? (int)(0u - n) : (int)n;
+	return p;
+}
+
+// Appends the decimal representation of i to s, without going through iostreams.
+inline void appendInt(std::string& s, int i)
+{
+	char buf[12];
+	char* p = buf + sizeof(buf);
+	unsigned int n = i < 0 ? 0u - (unsigned int)i : (unsigned int)i;
+	do {
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	if (i < 0) *--p = '-';
+	s.append(p, buf + sizeof(buf));
+}
+
+// Returns the number of chars appendInt appends for i.
+inline size_t intSize(int i)
+{
+	size_t size = i < 0 ? 2 : 1;
+	for (unsigned int n = i < 0 ? 0u - (unsigned int)i : (unsigned int)i; n >= 10; n /= 10)
+		size++;
+	return size;
+}
+
+// Converts the leading integer of s like atoi() does: leading whitespace and a '+' sign
+// are allowed, trailing garbage is ignored and anything unparsable yields 0.
+inline int toInt(const StringRef& s)
+{
+	const char* p = s.begin();
+	while (p != s.end() && isspace(*p)) p++;
+	if (p != s.end() && *p == '+') {
+		p++;
+		if (p != s.end() && *p == '-') return 0; // One sign only, like atoi
+	}
+
+	int i = 0;
+	parseInt(p, s.end(), i);
+	return i;
+}
+
 // A TokenWalker iterates over some source that emits chars, then uses
 // boost::tokenizer to convert this into tokens based on a separator char. 
 template <class SI> // SI: Source iterator
@@ -82,4 +190,74 @@ public:
 		TokenWalker<std::string::const_iterator>(s.begin(), s.end(), sep, emptyTokens) {}
 };
 
+// StringRefTokenWalker offers the TokenWalker interface on a StringRef, but splits the
+// referenced chars in place: tokens are handed out as StringRefs into the source, and
+// only tryNext(std::string&) copies. With unescape set, each token is unescaped in place
+// (see IlmpCodec) as it is handed out, so the referenced chars must be writable then.
+class StringRefTokenWalker {
+public:
+	StringRefTokenWalker(const StringRef& s, char _sep, bool emptyTokens_ = false, bool unescape_ = false) :
+			rest(s), sep(_sep), emptyTokens(emptyTokens_), unescape(unescape_), done(s.empty()) {}
+
+	bool tryNext(StringRef& token) {
+		while (!done) {
+			const char* s = static_cast<const char*>(memchr(rest.begin(), sep, rest.size()));
+			if (s) {
+				token = StringRef(rest.begin(), s);
+				rest = StringRef(s + 1, rest.end());
+			}
+			else {
+				token = rest;
+				done = true;
+			}
+			if (unescape) {
+				char* first = const_cast<char*>(token.begin());
+				token = StringRef(first, IlmpCodec::unescapeInPlace(first, first + token.size()));
+			}
+			if (emptyTokens || !token.empty())
+				return true;
+		}
+		token = StringRef();
+		return false;
+	}
+
+	bool tryNext(int& i, int def = 0) {
+		StringRef s;
+		if (tryNext(s)) {
+			i = toInt(s);
+			return true;
+		}
+		i = def;
+		return false;
+	}
+
+	bool tryNext(std::string& s, const std::string& def = "") {
+		StringRef r;
+		if (tryNext(r)) {
+			s.assign(r.begin(), r.end());
+			return true;
+		}
+		s = def;
+		return false;
+	}
+
+	template<class T>
+	void next(T& i) {
+		if (!tryNext(i))
+			throw TokenExpectedException(); 
+	}
+
+	bool skip() {
+		StringRef vd;
+		return tryNext(vd);
+	}
+
+private:
+	StringRef rest;
+	char sep;
+	bool emptyTokens;
+	bool unescape;
+	bool done;
+};
+
 #endif
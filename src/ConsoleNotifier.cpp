@@ -19,8 +19,12 @@
 #define USERAGENT SITENAME " Notifier/1.2.0 (Linux)"
 
 #include <unistd.h>
+#include <cstdlib>
 #include <string>
 #include <list>
+#include <vector>
+#include <iomanip>
+#include <cstring>
 
 #include <signal.h>
 
@@ -61,6 +65,39 @@ public:
 			std::cout << (i == items.begin() ? "Tooltip:  " : "          ") << (*i) << std::endl;
 	}
 
+	// Replays online/offline events of contacts through the user stream commands, as the
+	// server sends them, and prints the time they take; each event updates the tooltip.
+	void benchPresence(int contacts, int events)
+	{
+		std::vector<std::string> frames;
+		std::vector<bool> online(contacts);
+		unsigned seed = 1;
+		for (int i = 0; i < events; i++) {
+			// All contacts come online first, then random ones go off- or online.
+			seed = seed * 1103515245u + 12345u;
+			int id = i < contacts ? i : (int)((seed >> 8) % contacts);
+			std::stringstream frame;
+			frame << (online[id] ? "offline" : "online") << "\004contact" << id << "\004" << id + 1 << "\0041"; // Silent
+			online[id] = !online[id];
+			frames.push_back(frame.str());
+		}
+
+		boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+		for (int i = 0; i < events; i++)
+			replayUserCommand(frames[i]);
+		double seconds = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+
+		std::cout << contacts << " contacts: " << events << " events in " << std::fixed << std::setprecision(3) << seconds
+				<< " s, " << std::setprecision(2) << seconds * 1e6 / events << " us per event; "
+				<< users.size() << " online at the end" << std::endl;
+	}
+
+	virtual std::string stateCachePath()
+	{
+		const char* home = getenv("HOME");
+		return home ? std::string(home) + "/.notifier-state" : "";
+	}
+
 };
 
 boost::asio::io_service runloop;
@@ -72,14 +109,186 @@ void handle_sigint(int sig)
 	runloop.post(boost::bind(&ConsoleNotifier::quit, &notifier));
 }
 
-int main()
+// Simulates clients dropped at once by a server that is down for outage seconds, and prints
+// how their reconnect attempts spread over time, for each kind of jitter.
+void simulateReconnects(int clients, int outage, int retryAfter)
 {
+	const char* names[] = { "Full jitter", "Decorrelated jitter" };
+	IlmpReconnectScheduler::Jitter jitters[] = { IlmpReconnectScheduler::fullJitter, IlmpReconnectScheduler::decorrelatedJitter };
+	boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+	const int bucket = 10; // Seconds
+
+	for (int j = 0; j < 2; j++) {
+		std::vector<int> perSecond;
+		int attempts = 0;
+		for (int c = 0; c < clients; c++) {
+			IlmpReconnectScheduler scheduler(jitters[j], c * 7919 + 1);
+			if (retryAfter) scheduler.setRetryAfter(retryAfter * 1000);
+			long t = 0; // Milliseconds
+			do {
+				t += scheduler.nextDelay(start + boost::posix_time::milliseconds(t));
+				size_t second = t / 1000;
+				if (perSecond.size() <= second) perSecond.resize(second + 1);
+				perSecond[second]++;
+				attempts++;
+			} while (t < outage * 1000L);
+		}
+
+		std::vector<int> perBucket(perSecond.size() / bucket + 1);
+		int peak = 0;
+		for (size_t i = 0; i < perSecond.size(); i++) {
+			perBucket[i / bucket] += perSecond[i];
+			peak = std::max(peak, perSecond[i]);
+		}
+		int highest = *std::max_element(perBucket.begin(), perBucket.end());
+
+		std::cout << names[j] << ": " << attempts << " attempts by " << clients << " clients, last at "
+				<< perSecond.size() - 1 << "s, at most " << peak << " in a second" << std::endl;
+		for (size_t i = 0; i < perBucket.size(); i++) {
+			std::cout << "  " << std::setw(5) << i * bucket << "s " << std::setw(7) << perBucket[i] << " "
+					<< std::string(highest ? perBucket[i] * 50 / highest : 0, '#') << std::endl;
+		}
+	}
+}
+
+static double secondsSince(const boost::posix_time::ptime& start)
+{
+	return (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+}
+
+// Walks typical callback params with StringTokenWalker (copying, atoi) and with
+// StringRefTokenWalker (in place, parseInt), and prints the tokens per second of each.
+void benchTokens(int frames)
+{
+	std::string frame("online\004alice_in_wonderland\004123456\0041\004stats\004100\00430\00440");
+	const int tokens = 8;
+	long sum[2] = { 0, 0 }; // Keeps the parsing from being optimized away, and compares both
+	double seconds[2];
+
+	boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+	for (int i = 0; i < frames; i++) {
+		StringTokenWalker params(frame, '\004', true);
+		std::string cmd, name;
+		int a, b, c, d, e;
+		params.tryNext(cmd); params.tryNext(name); params.tryNext(a); params.tryNext(b);
+		params.tryNext(cmd); params.tryNext(c); params.tryNext(d); params.tryNext(e);
+		sum[0] += a + b + c + d + e + name.size();
+	}
+	seconds[0] = secondsSince(start);
+
+	start = boost::posix_time::microsec_clock::universal_time();
+	for (int i = 0; i < frames; i++) {
+		StringRefTokenWalker params(StringRef(frame.data(), frame.data() + frame.size()), '\004', true);
+		StringRef cmd, name;
+		int a, b, c, d, e;
+		params.tryNext(cmd); params.tryNext(name); params.tryNext(a); params.tryNext(b);
+		params.tryNext(cmd); params.tryNext(c); params.tryNext(d); params.tryNext(e);
+		sum[1] += a + b + c + d + e + name.size();
+	}
+	seconds[1] = secondsSince(start);
+
+	const char* names[] = { "StringTokenWalker", "StringRefTokenWalker" };
+	for (int i = 0; i < 2; i++) {
+		std::cout << std::setw(22) << std::left << names[i] << std::right << std::fixed << std::setprecision(1)
+				<< std::setw(8) << frames * (double)tokens / seconds[i] / 1e6 << " M tokens/s" << std::endl;
+	}
+	std::cout << "Speedup " << seconds[0] / seconds[1] << "x" << (sum[0] == sum[1] ? "" : "; results differ!") << std::endl;
+}
+
+// Escapes short params and a large JSON payload through each path of IlmpCodec, checks that
+// the paths agree and that unescaping restores the input, and prints the throughput.
+void benchCodec(int megabytes)
+{
+	// A chat line with an escapable char now and then, and a JSON list of contacts.
+	std::string line("Hoi! Zin om vanavond te chatten? \003 Groetjes, alice");
+	std::string json("[");
+	for (int i = 0; json.size() < 1u << 20; i++) {
+		std::stringstream contact;
+		contact << "{\"id\":" << i << ",\"name\":\"contact " << i << "\",\"status\":\"online\",\"text\":\"lorem ipsum dolor sit amet\"},";
+		json += contact.str();
+		if (i % 40 == 0) json += '\002';
+	}
+	json += "]";
+
+	const char* payloadNames[] = { "short params", "1 MB JSON" };
+	const std::string* payloads[] = { &line, &json };
+	const char* pathNames[] = { "scalar", "sse2", "avx2" };
+	IlmpCodec::Path paths[] = { IlmpCodec::scalar, IlmpCodec::sse2, IlmpCodec::avx2 };
+
+	for (int p = 0; p < 2; p++) {
+		const std::string& in = *payloads[p];
+		int rounds = std::max(1, (int)((megabytes << 20) / in.size()));
+		std::cout << payloadNames[p] << " (" << in.size() << " bytes):" << std::endl;
+
+		std::string reference, out;
+		for (int i = 0; i < 3; i++) {
+			out.clear();
+			if (!IlmpCodec::appendEscaped(out, in.data(), in.data() + in.size(), paths[i])) {
+				std::cout << "  escape, " << pathNames[i] << ": not available" << std::endl;
+				continue;
+			}
+			boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+			for (int r = 0; r < rounds; r++) {
+				out.clear();
+				IlmpCodec::appendEscaped(out, in.data(), in.data() + in.size(), paths[i]);
+			}
+			double seconds = secondsSince(start);
+			if (reference.empty())
+				reference = out;
+			std::cout << "  escape, " << std::setw(7) << std::left << pathNames[i] << std::right << std::fixed
+					<< std::setprecision(2) << std::setw(6) << rounds * (double)in.size() / seconds / 1e9 << " GB/s"
+					<< (out == reference ? "" : "; output differs from scalar!") << std::endl;
+		}
+
+		// Unescaping works in place, so it is timed on batches of copies made beforehand.
+		int batch = std::max(1, std::min(rounds, (int)((16u << 20) / in.size())));
+		std::vector<std::string> bufs(batch);
+		std::vector<char*> ends(batch);
+		double seconds = 0;
+		bool restored = true;
+		for (int r = 0; r < rounds; r += batch) {
+			for (int b = 0; b < batch; b++)
+				bufs[b] = reference;
+			boost::posix_time::ptime start(boost::posix_time::microsec_clock::universal_time());
+			for (int b = 0; b < batch; b++)
+				ends[b] = IlmpCodec::unescapeInPlace(&bufs[b][0], &bufs[b][0] + bufs[b].size());
+			seconds += secondsSince(start);
+			for (int b = 0; b < batch; b++)
+				restored = restored && std::string(&bufs[b][0], ends[b]) == in;
+		}
+		rounds = (rounds + batch - 1) / batch * batch;
+		std::cout << "  unescape       " << std::setw(6) << rounds * (double)in.size() / seconds / 1e9 << " GB/s"
+				<< (restored ? "" : "; does not restore the input!") << std::endl;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc >= 3 && !strcmp(argv[1], "--simulate-reconnects")) {
+		simulateReconnects(atoi(argv[2]), argc >= 4 ? atoi(argv[3]) : 60, argc >= 5 ? atoi(argv[4]) : 0);
+		return 0;
+	}
+	if (argc >= 2 && !strcmp(argv[1], "--bench-codec")) {
+		benchCodec(argc >= 3 ? atoi(argv[2]) : 256);
+		return 0;
+	}
+	if (argc >= 2 && !strcmp(argv[1], "--bench-presence")) {
+		boost::asio::io_service ioService;
+		ConsoleNotifier benchNotifier(ioService);
+		benchNotifier.benchPresence(argc >= 3 ? atoi(argv[2]) : 20000, argc >= 4 ? atoi(argv[3]) : 50000);
+		return 0;
+	}
+	if (argc >= 2 && !strcmp(argv[1], "--bench-tokens")) {
+		benchTokens(argc >= 3 ? atoi(argv[2]) : 1000000);
+		return 0;
+	}
+
 	struct sigaction sa;
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = &handle_sigint;
 	sigaction(SIGINT, &sa, NULL);
 
-	runloop.post(boost::bind(&Notifier::setEnabled, &notifier, true, false));
+	runloop.post(boost::bind(&Notifier::initialize, &notifier));
 	runloop.run();
 	
 	std::cout << "ConsoleNotifier runloop complete" << std::endl;
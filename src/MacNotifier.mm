@@ -90,6 +90,8 @@ void uiRunloopPost(SEL selector, ...)
 class MacNotifier : public Notifier
 {
 	bool popups;
+
+	IlmpRpc<std::string> rpcSetMotdSong;
 	
 	// Delegating menu updates {{{
 	NSMutableArray *tooltipArray;
@@ -139,8 +141,8 @@ class MacNotifier : public Notifier
 	
 public:
 	MacNotifier(boost::asio::io_service& ioService_) :
-			Notifier(ioService_), popups(false), tooltipArray(0), iconIcon(ICON_GRAY), iconTitle(@""),
-			blinkTimer() {
+			Notifier(ioService_), popups(false), rpcSetMotdSong("User.setMotdSong"), tooltipArray(0),
+			iconIcon(ICON_GRAY), iconTitle(@""), blinkTimer() {
 	}
 
 	~MacNotifier()
@@ -161,7 +163,7 @@ public:
 	void setMotdSong(std::string& motd)
 	{
 		if (status != s_enabled) return;
-		(IlmpCommand(ilmp.get(), "User.setMotdSong") << motd).send();
+		rpcSetMotdSong(ilmp.get(), motd);
 	}
 	
 	virtual void initialize() {
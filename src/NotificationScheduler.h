@@ -0,0 +1,170 @@
+/*
+ * Paiq notifier framework - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NOTIFICATION_SCHEDULER_H
+#define NOTIFICATION_SCHEDULER_H
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+// NotificationScheduler holds back bursts of popups. Popups are posted in a category; the
+// first popup of a category is shown right away and opens the aggregation window. The
+// popups that come in within the window are shown together at its end: a single one as it
+// is, more of them as one summary ("40 contacten online"), which opens the next window.
+// Each category also has a token bucket, so that no more than burst popups are shown at
+// once and no more than one per refill interval after that. While a category is out of
+// tokens, its popups keep being aggregated.
+class NotificationScheduler : boost::noncopyable {
+public:
+	typedef boost::function<void(const std::string& title, const std::string& text, const std::string& url)> Sink;
+
+	NotificationScheduler(boost::asio::io_service& ioService_, const Sink& sink_) : ioService(ioService_), sink(sink_) {}
+
+	// Adds a category and returns its id. A summary reads "<count><summary>". Times are in
+	// milliseconds.
+	int addCategory(const std::string& summary, int window, int burst, int refillInterval)
+	{
+		categories.push_back(Category());
+		Category& c = categories.back();
+		c.summary = summary;
+		c.window = boost::posix_time::milliseconds(window);
+		c.burst = c.tokens = burst;
+		c.refillInterval = boost::posix_time::milliseconds(refillInterval);
+		c.refilled = now();
+		c.count = 0;
+		c.generation = 0;
+		return categories.size() - 1;
+	}
+
+	void post(int category, const std::string& title, const std::string& text, const std::string& url)
+	{
+		Category& c = categories[category];
+		c.title = title;
+		c.text = text;
+		c.url = url;
+		if (!c.timer) {
+			refill(c);
+			if (c.tokens > 0) {
+				// Outside a window: show it now and aggregate the ones that follow.
+				c.tokens--;
+				openWindow(category);
+				sink(title, text, url);
+				return;
+			}
+			openWindow(category);
+		}
+		c.count++;
+	}
+
+	// Drops all popups that are held back.
+	void cancel()
+	{
+		for (std::vector<Category>::iterator it = categories.begin(); it != categories.end(); it++) {
+			it->timer.reset();
+			it->count = 0;
+			it->generation++; // A wait that completed already may still be queued
+		}
+	}
+
+private:
+	struct Category {
+		std::string summary;
+		boost::posix_time::time_duration window;
+
+		// Token bucket
+		int burst;
+		int tokens;
+		boost::posix_time::time_duration refillInterval;
+		boost::posix_time::ptime refilled; // Time the last token was added
+
+		// Popups held back: their number and the last one.
+		int count;
+		std::string title, text, url;
+		boost::shared_ptr<boost::asio::deadline_timer> timer; // Set while a window is open
+		int generation; // Bumped by cancel(), so timer handlers from before it are ignored
+	};
+
+	boost::asio::io_service& ioService;
+	Sink sink;
+	std::vector<Category> categories;
+
+	static boost::posix_time::ptime now() { return boost::posix_time::microsec_clock::universal_time(); }
+
+	void refill(Category& c)
+	{
+		if (c.tokens >= c.burst) {
+			c.refilled = now();
+			return;
+		}
+		boost::posix_time::time_duration elapsed = now() - c.refilled;
+		long n = elapsed.total_milliseconds() / std::max(1L, (long)c.refillInterval.total_milliseconds());
+		if (n > 0) {
+			c.tokens = (int)std::min((long)c.burst, c.tokens + n);
+			c.refilled += c.refillInterval * (int)n;
+		}
+	}
+
+	void openWindow(int category)
+	{
+		Category& c = categories[category];
+		c.timer.reset(new boost::asio::deadline_timer(ioService));
+		c.timer->expires_from_now(c.window);
+		c.timer->async_wait(boost::bind(&NotificationScheduler::onTimer, this, category, c.generation, boost::asio::placeholders::error));
+	}
+
+	void onTimer(int category, int generation, const boost::system::error_code& err)
+	{
+		Category& c = categories[category];
+		if (err == boost::asio::error::operation_aborted || generation != c.generation)
+			return;
+		if (c.count == 0) {
+			c.timer.reset(); // Nothing came in within the window
+			return;
+		}
+
+		refill(c);
+		if (c.tokens == 0) {
+			// Keep aggregating until the next token comes in.
+			c.timer->expires_at(c.refilled + c.refillInterval);
+			c.timer->async_wait(boost::bind(&NotificationScheduler::onTimer, this, category, c.generation, boost::asio::placeholders::error));
+			return;
+		}
+		c.tokens--;
+
+		int count = c.count;
+		c.count = 0;
+		c.timer->expires_from_now(c.window);
+		c.timer->async_wait(boost::bind(&NotificationScheduler::onTimer, this, category, c.generation, boost::asio::placeholders::error));
+		if (count == 1)
+			sink(c.title, c.text, c.url);
+		else {
+			std::stringstream text; text << count << c.summary;
+			sink(c.title, text.str(), c.url);
+		}
+	}
+};
+
+#endif
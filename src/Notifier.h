@@ -22,23 +22,75 @@
 #include <string>
 #include <map>
 #include <utility>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
 
 #include <boost/function.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
-#include <boost/algorithm/string/join.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/functional/hash.hpp>
 
 #include "../ext/ilmpclient/IlmpStream.h"
+#include "../ext/ilmpclient/IlmpRpc.h"
+#include "../ext/ilmpclient/IlmpDispatchTable.h"
+#include "../ext/ilmpclient/IlmpServerPool.h"
+#include "../ext/ilmpclient/IlmpReconnectScheduler.h"
 #include "../ext/ilmpclient/TokenWalker.h"
 
 #include "../ext/dsa_verify/dsa_verify.h"
 
+#include "PresenceStore.h"
+#include "NotificationScheduler.h"
+#include "StateCache.h"
+
 #define APPNAME (SITENAME " App")
 
+// Minimum time between two icon or tooltip updates to the frontend, in milliseconds.
+#ifndef OUTPUT_INTERVAL
+#define OUTPUT_INTERVAL 100
+#endif
+
+// Popups of a kind that come in within this many milliseconds are shown together.
+#ifndef NOTIFY_WINDOW
+#define NOTIFY_WINDOW 2000
+#endif
+
+// Number of online contacts listed by name in the tooltip.
+#ifndef TOOLTIP_USERS
+#define TOOLTIP_USERS 10
+#endif
+
+// Interval at which the state is saved when it changed, in milliseconds.
+#ifndef STATE_SAVE_INTERVAL
+#define STATE_SAVE_INTERVAL 60000
+#endif
+
+// Time after the welcome within which restored contacts must be reported online again
+// to stay listed, in milliseconds.
+#ifndef STATE_RECONCILE_GRACE
+#define STATE_RECONCILE_GRACE 5000
+#endif
+
+// ILCS servers to connect to, as "host:port" separated by commas.
+#ifndef ILMPSERVERS
+#define ILMPSERVERS ILMPHOST ":" ILMPPORT
+#endif
+
+// Minimum time between two moves off a degraded server, in seconds.
+#ifndef SERVER_MIGRATE_INTERVAL
+#define SERVER_MIGRATE_INTERVAL 600
+#endif
+
+// Time a standby stream gets to replace the current one, in milliseconds.
+#ifndef RELOAD_TIMEOUT
+#define RELOAD_TIMEOUT 15000
+#endif
+
 using boost::asio::ip::tcp;
 
-typedef std::pair<int, std::string> User;
 typedef enum {
 	s_disconnected, // ILMP stream disconnected, no attempt at connecting
 	s_connecting,	// Trying to setup ILMP stream or pre-auth while ILMP connected
@@ -53,6 +105,37 @@ typedef enum {
 	i_disabled
 } Icon;
 
+// State of a Notifier at a given version, as handed to a NotifierObserver when it is added.
+struct NotifierSnapshot {
+	unsigned version;
+	Status status;
+	std::string userName;
+	int unreadMsgs;
+	int onlineUsers;
+	int maleUsers;
+	int femaleUsers;
+	std::vector<std::pair<int, std::string> > users; // Online contacts, most recently online first
+};
+
+// NotifierObserver receives the changes to the state of a Notifier one by one, for
+// frontends that update their UI incrementally rather than from the tooltip and icon. An
+// observer first gets a snapshot, then the changes after it. Every change increments the
+// version, which is passed along; contact changes come as they happen, the others once
+// per batch of updates.
+class NotifierObserver {
+public:
+	virtual ~NotifierObserver() {}
+
+	virtual void onSnapshot(const NotifierSnapshot& snapshot) {}
+	virtual void onStatusChanged(unsigned version, Status status, const std::string& userName) {}
+	virtual void onUserOnline(unsigned version, int id, const std::string& name) {}
+		// Also sent when an online contact changes name.
+	virtual void onUserOffline(unsigned version, int id) {}
+	virtual void onUsersCleared(unsigned version) {}
+	virtual void onUnreadChanged(unsigned version, int unreadMsgs) {}
+	virtual void onStatsChanged(unsigned version, int onlineUsers, int maleUsers, int femaleUsers) {}
+};
+
 class Notifier : boost::noncopyable {
 protected:
 	boost::shared_ptr<IlmpStream> ilmp;
@@ -67,7 +150,7 @@ protected:
 	int userId;
 	std::string userName;
 	int unreadMsgs;
-	std::map<int,User> users;
+	PresenceStore users;
 	
 	int maleUsers;
 	int femaleUsers;
@@ -79,29 +162,82 @@ protected:
 		// Whether we needed authorization to get logged in. Used to control whether to
 		// show the '... is nu online' notification.
 
+	// Holds back the popups for contacts coming online and new messages, so bursts of them
+	// are shown as one. Popups from the server are shown directly.
+	NotificationScheduler notifications;
+	int onlineNotifications;
+	int msgNotifications;
+
+	// Remote procedures we call
+	IlmpRpc<std::string, int> rpcLog; // msg, isError
+	IlmpRpc<std::string, IlmpRpcCallback> rpcCheckForUpdate; // userAgent, cb
+	IlmpRpc<std::string, std::string, IlmpRpcCallback, int> rpcUserClient; // cookie, userAgent, cb, version
+	IlmpRpc<IlmpRpcCallback> rpcStreamStats;
+	IlmpRpc<IlmpRpcCallback> rpcStreamUser;
+	IlmpRpc<std::string> rpcKillByCookie;
+
 	void sout(const std::string& msg)
 	{
-		if (ilmp) (IlmpCommand(ilmp.get(), "Notifier.log") << msg << 0).send();
+		if (ilmp) rpcLog(ilmp.get(), msg, 0);
 		std::cout << msg << std::endl;
 	}
 
 	void serr(const std::string& msg)
 	{
-		if (ilmp) (IlmpCommand(ilmp.get(), "Notifier.log") << msg << 1).send();
+		if (ilmp) rpcLog(ilmp.get(), msg, 1);
 		std::cerr << msg << std::endl;
 	}
 
+	// Runs a command of the user stream as if the server sent it, given as the params of its
+	// callback (separated by \004, unescaped), e.g. to replay events.
+	void replayUserCommand(std::string& params)
+	{
+		StringRefTokenWalker tokens(StringRef(&params[0], &params[0] + params.size()), '\004', true);
+		StringRef cmd; tokens.next(cmd);
+		runUserCommand(cmd, tokens);
+	}
+
 private:
 	bool isEnabled;
 		// Whether we should try to get ourself a userId associated. When !isEnabled, we
 		// still connect to get the notifier stats.
 
-	int retryTime;
+	IlmpReconnectScheduler reconnects;
 	int retries;
 
 	std::auto_ptr<boost::asio::deadline_timer> reconnectTimer;
-	void onIlmpError(int e, const std::string& msg)
+	void scheduleReconnect(const std::string& reason)
 	{
+		int delay = reconnects.nextDelay(boost::posix_time::microsec_clock::universal_time());
+		std::cerr << reason << "; reconnecting in " << delay / 1000.0 << " seconds." << std::endl;
+
+		reconnectTimer.reset(new boost::asio::deadline_timer(ioService));
+		reconnectTimer->expires_from_now(boost::posix_time::milliseconds(delay));
+		reconnectTimer->async_wait(boost::bind(&Notifier::onReconnectTimer, this, boost::asio::placeholders::error));
+	}
+
+	void onIlmpError(IlmpStream* stream, int e, const std::string& msg)
+	{
+		if (stream != ilmp.get())
+			return; // Posted by a stream replaced since, e.g. by a promoted standby
+		if (e != ILMPERR_PROTOVER)
+			servers.failed(server);
+
+		if (standby && e != ILMPERR_PROTOVER) {
+			// The standby takes over, or, now that there is no current stream to fall back to,
+			// we reconnect.
+			std::cerr << "Ilmp error: " << msg << "; waiting for standby stream" << std::endl;
+			ilmp->close();
+			standbyReload = true;
+			// Not connected meanwhile; the contacts are kept as stale, for the standby's
+			// welcome to reconcile.
+			stateStale = true;
+			reconcileTimer.reset();
+			toStatus(s_connecting);
+			return;
+		}
+
+		dropStandby(); // An update push is not to be swallowed by the standby taking over
 		toStatus(s_disconnected);
 		
 		if (e == ILMPERR_PROTOVER) {
@@ -109,24 +245,23 @@ private:
 			// Update push on ILCS protocol level.
 			std::cerr << "Protocol version error." << std::endl;
 			needUpdate(msg);
+			if (ilmp && ilmp->retryAfter) {
+				// The server wants us back after all, e.g. while a new version is rolled out.
+				reconnects.setRetryAfter(ilmp->retryAfter * 1000);
+				scheduleReconnect("Server asked to retry");
+			}
 		}
 		else if (e == ILMPERR_PROTOCOL) {
 			std::cerr << "Protocol error: " << msg << ". " << (retries--) << " tries left before giving up." << std::endl;
-			if (retries > 0) connect();
+			if (retries > 0) scheduleReconnect("Protocol error");
 		}
 		else { //(e == ILMPERR_NETWORK)
-			if (ilmp && ilmp->wasConnected) retryTime = 5;
-			else retryTime = std::min(60*10, retryTime*2); // Maximum of 10 minutes.
-
-			std::cerr << "Ilmp error: " << msg << "; reconnecting in " << retryTime << " seconds." << std::endl;
 			std::stringstream connectErrorMsg;
 			connectErrorMsg << "Fout bij verbinden: " << msg;
 			connectError = connectErrorMsg.str();
 			dataChanged();
 
-			reconnectTimer.reset(new boost::asio::deadline_timer(ioService));
-			reconnectTimer->expires_from_now(boost::posix_time::seconds(retryTime));
-			reconnectTimer->async_wait(boost::bind(&Notifier::onReconnectTimer, this, boost::asio::placeholders::error));
+			scheduleReconnect("Ilmp error: " + msg);
 		}
 	}
 
@@ -141,156 +276,308 @@ private:
 	void onIlmpReady()
 	{
 		cookie = getConfigValue("cookie");
+		preferredEndpoint = ilmp->remoteEndpoint();
+		servers.connected(server, ilmp->connectLatency());
+		reconnects.succeeded();
 
 #ifdef DSA_PUBLIC_KEY
-		(IlmpCommand(ilmp.get(), "Notifier.checkForUpdate") << userAgent << boost::bind(&Notifier::updateAvailable, this, _1)).send();
+		rpcCheckForUpdate(ilmp.get(), userAgent, boost::bind(&Notifier::updateAvailable, this, _1));
 #endif
-		(IlmpCommand(ilmp.get(), "User.client") << cookie << userAgent << boost::bind(&Notifier::cbClient, this, _1) << 8).send();
-		(IlmpCommand(ilmp.get(), "Notifier.streamStats") << boost::bind(&Notifier::cbStats, this, _1)).send();
+		rpcUserClient(ilmp.get(), cookie, userAgent, boost::bind(&Notifier::cbClient, this, _1), 8);
+		rpcStreamStats(ilmp.get(), boost::bind(&Notifier::cbStats, this, _1));
+
+		// With the cookie of a user that was logged in before, subscribe to the user stream
+		// right away rather than after the auth, so the welcome comes a round trip earlier.
+		// onAuth cancels the subscription when the cookie turns out to be of another user.
+		speculativeUserId = toInt(getConfigValue("userId"));
+		if (isEnabled && cookie.size() && speculativeUserId && !userCb)
+			rpcStreamUser(ilmp.get(), IlmpRpcCallback(boost::bind(&Notifier::cbUser, this, _1), &userCb));
+		else
+			speculativeUserId = 0;
 	}
 
+	int speculativeUserId; // User subscribed to before the auth, if any
+
 	void connect()
 	{
 		disconnect();
 		
 		toStatus(s_connecting);
 
-		ilmp = boost::shared_ptr<IlmpStream>(new IlmpStream(ioService, ILMPHOST, ILMPPORT, ILMPSITEDIR));
+		server = servers.pick();
+		ilmp = createStream(server);
 		ilmp->onReady = boost::bind(&Notifier::onIlmpReady, this);
-		ilmp->onError = boost::bind(&Notifier::onIlmpError, this, _1, _2);
+		ilmp->onError = boost::bind(&Notifier::onIlmpError, this, ilmp.get(), _1, _2);
+		ilmp->setPreferredEndpoint(preferredEndpoint);
 
 		ilmp->connect();
 	}
 
-	void cbClient(StringTokenWalker& params)
+	// Servers {{{
+	// The server of each connect is picked from the pool by health. The pool learns from
+	// connect latencies, ping round trips and errors; when the server in use turns out to do
+	// much worse than another, the session moves over make-before-break, as on "reload".
+
+	IlmpServerPool servers;
+	size_t server; // Server of ilmp
+	boost::posix_time::ptime lastMigration;
+
+	boost::shared_ptr<IlmpStream> createStream(size_t i)
 	{
-		std::string cmd; params.next(cmd);
-		
-		if (cmd == "auth") {
-			params.next(cookie);
-			params.next(userId);
-			//std::string challenge; params.next(challenge);
-			
-			setConfigValue("cookie", cookie);
-			connectError = "";
-			toStatus(s_connected);
-
-			if (!userId) neededAuthorization = true;
-
-			// Depending on whether we have a userId now and we want to be enabled (isEnabled),
-			// we might want to open our authorization page or subscribe to Notifier.streamUser.
-			setEnabled(isEnabled, false);
-		}
-		else if (cmd == "popup") {
-			std::string msg; params.tryNext(msg);
-			std::string url; params.tryNext(url);
-			std::string title; params.tryNext(title, SITENAME);
-			int sticky; params.tryNext(sticky);
-			int prio; params.tryNext(prio);
-			
-			notify(msg.length() ? title : "", msg, url, !!sticky, !!prio);
-		}
-		else if (cmd == "reload") {
-			std::cout << "Got 'reload' command; scheduling reconnect" << std::endl;
-			
-			notify(APPNAME, "Verbinding verbroken", "", false, true);
-			setConfigValue("enabled", "false");
-			userCb = 0;
-			ioService.post(boost::bind(&Notifier::reconnect, this));
-		}
-		else if (cmd == "update") {
-			// Update push on backend protocol level.
-			std::string updateUrl; params.tryNext(updateUrl, "");
-			needUpdate(updateUrl);
+		boost::shared_ptr<IlmpStream> stream(new IlmpStream(ioService, servers[i].host, servers[i].port, ILMPSITEDIR));
+		stream->onBatchBegin = boost::bind(&Notifier::beginBatch, this);
+		stream->onBatchEnd = boost::bind(&Notifier::endBatch, this);
+		stream->onRtt = boost::bind(&Notifier::onRtt, this, stream.get(), _1);
+		return stream;
+	}
+
+	void onRtt(IlmpStream* stream, int ms)
+	{
+		if (stream != ilmp.get())
+			return;
+		servers.rtt(server, ms);
+
+		boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
+		if (servers.degraded(server) && status == s_enabled && isEnabled && !standby
+				&& (lastMigration.is_not_a_date_time() || now - lastMigration > boost::posix_time::seconds(SERVER_MIGRATE_INTERVAL))) {
+			std::cout << "Server " << servers[server].host << " is degraded; moving to another" << std::endl;
+			lastMigration = now;
+			startStandby(false);
 		}
+	}
+	// }}}
+
+	// Commands on our callbacks are dispatched through tables of these handlers. A handler
+	// reads the remaining params of its command and returns whether it changed any data
+	// that dataChanged() shows.
+	typedef bool (Notifier::*CommandHandler)(StringRefTokenWalker& params);
+	IlmpDispatchTable<CommandHandler> clientCommands;
+	IlmpDispatchTable<CommandHandler> userCommands;
+
+	void initCommands()
+	{
+		clientCommands.add("auth", &Notifier::onAuth);
+		clientCommands.add("popup", &Notifier::onPopup);
+		clientCommands.add("reload", &Notifier::onReload);
+		clientCommands.add("update", &Notifier::onUpdate);
+		clientCommands.build();
+
+		userCommands.add("welcome", &Notifier::onWelcome);
+		userCommands.add("online", &Notifier::onOnline);
+		userCommands.add("offline", &Notifier::onOffline);
+		userCommands.add("msg", &Notifier::onMsg);
+		userCommands.add("smsg", &Notifier::onSmsg);
+		userCommands.add("read", &Notifier::onRead);
+		userCommands.add("popup", &Notifier::onPopup);
+		userCommands.build();
+	}
+
+	void cbClient(StringRefTokenWalker& params)
+	{
+		StringRef cmd; params.next(cmd);
+		runClientCommand(cmd, params);
+	}
+
+	void runClientCommand(const StringRef& cmd, StringRefTokenWalker& params)
+	{
+		CommandHandler handler = clientCommands.find(cmd);
+		if (handler)
+			(this->*handler)(params);
 		else
-			std::cerr << "Unknown command from ILCS on client callback: " << cmd << std::endl;
+			std::cerr << "Unknown command from ILCS on client callback: " << cmd.str() << std::endl;
+	}
+
+	bool onAuth(StringRefTokenWalker& params)
+	{
+		params.next(cookie);
+		params.next(userId);
+		//std::string challenge; params.next(challenge);
+		
+		setConfigValue("cookie", cookie);
+		std::stringstream userIdStr; userIdStr << userId;
+		setConfigValue("userId", userIdStr.str());
+		if (stateStale && (!userId || userId != cachedUserId || !isEnabled))
+			dropRestoredState(); // Not the state of this session
+		connectError = "";
+
+		bool wrongUser = speculativeUserId && userId != speculativeUserId;
+		speculativeUserId = 0;
+		if (wrongUser && userCb)
+			userCb->cancel(); // setEnabled subscribes again when there is a user
+		if (status != s_enabled || wrongUser)
+			toStatus(s_connected); // The speculative welcome may have come first
+
+		if (!userId) neededAuthorization = true;
+
+		// Depending on whether we have a userId now and we want to be enabled (isEnabled),
+		// we might want to open our authorization page or subscribe to Notifier.streamUser.
+		setEnabled(isEnabled, false);
+		return false;
+	}
+
+	bool onPopup(StringRefTokenWalker& params)
+	{
+		std::string msg; params.tryNext(msg);
+		std::string url; params.tryNext(url);
+		std::string title; params.tryNext(title, SITENAME);
+		int sticky; params.tryNext(sticky);
+		int prio; params.tryNext(prio);
+		
+		notify(msg.length() ? title : "", msg, url, !!sticky, !!prio);
+		return true;
+	}
+
+	bool onReload(StringRefTokenWalker& params)
+	{
+		// The server may tell how long it takes to be back, for when we have to reconnect.
+		int retryAfter; params.tryNext(retryAfter);
+		if (retryAfter) reconnects.setRetryAfter(retryAfter * 1000);
+
+		if (status == s_enabled && isEnabled && !standby) {
+			std::cout << "Got 'reload' command; connecting standby stream" << std::endl;
+			startStandby(true);
+			return false;
+		}
+
+		std::cout << "Got 'reload' command; scheduling reconnect" << std::endl;
+		reloadByReconnect();
+		return false;
+	}
+
+	void reloadByReconnect()
+	{
+		notify(APPNAME, "Verbinding verbroken", "", false, true);
+		setConfigValue("enabled", "false");
+		userCb = 0;
+		// All clients get the reload at once, so the reconnect is spread like after a drop.
+		reconnects.succeeded();
+		scheduleReconnect("Reloading");
+	}
+
+	bool onUpdate(StringRefTokenWalker& params)
+	{
+		// Update push on backend protocol level.
+		std::string updateUrl; params.tryNext(updateUrl, "");
+		needUpdate(updateUrl);
+		return false;
 	}
 	
 	IlmpCallback* userCb;
-	void cbUser(StringTokenWalker& params) {
-		std::string cmd; params.next(cmd);
-		
+	void cbUser(StringRefTokenWalker& params) {
+		StringRef cmd; params.next(cmd);
+		runUserCommand(cmd, params);
+	}
+
+	void runUserCommand(const StringRef& cmd, StringRefTokenWalker& params)
+	{
+		CommandHandler handler = userCommands.find(cmd);
+		if (!handler) {
+			std::cerr << "Unknown command from ILCS on streamUser callback: " << cmd.str() << std::endl;
+			return;
+		}
+
 		bool hadUsers = !!users.size();
 		bool hadMsgs = !!unreadMsgs;
 		
-		std::string openUrl("http://" SITEHOST "/chat");
-
-		if (cmd == "welcome") {
-			params.skip(); // unused, used to be online users.
-			params.next(unreadMsgs);
-			params.skip(); // unused, used to be sd state.
-			params.next(userName);
-			
-			toStatus(s_enabled);
-			if (neededAuthorization) {
-				notify(APPNAME, "Verbonden!", openUrl, false, true);
-				neededAuthorization = false;
-			}
+		if (!(this->*handler)(params))
 			return;
+		
+		markDataChanged();
+		
+		if (hadUsers != !!users.size() || hadMsgs != !!unreadMsgs)
+			markStatusChanged();
+	}
+
+	bool onWelcome(StringRefTokenWalker& params)
+	{
+		params.skip(); // unused, used to be online users.
+		params.next(unreadMsgs);
+		params.skip(); // unused, used to be sd state.
+		params.next(userName);
+		
+		toStatus(s_enabled);
+		if (stateStale && !reconcileTimer.get()) {
+			// The contacts that are online are sent next; keep the restored ones that are among them.
+			users.markAllStale();
+			reconcileTimer.reset(new boost::asio::deadline_timer(ioService));
+			reconcileTimer->expires_from_now(boost::posix_time::milliseconds(STATE_RECONCILE_GRACE));
+			reconcileTimer->async_wait(boost::bind(&Notifier::onReconcileTimer, this, boost::asio::placeholders::error));
 		}
-		else if (cmd == "online") {
-			std::string name; params.next(name);
-			int id; params.next(id);
-			int silent; params.tryNext(silent, 0);
-			bool wasOnline = (users.find(id) != users.end());
-			users[id] = User(id, name);
-			if (!wasOnline && !silent) {
-				std::stringstream msg; msg << name << " is nu online";
-				notify(SITENAME, msg.str(), openUrl, false, false);
-			}
+		if (neededAuthorization) {
+			notify(APPNAME, "Verbonden!", "http://" SITEHOST "/chat", false, true);
+			neededAuthorization = false;
 		}
-		else if (cmd == "offline") {
-			std::string name; params.next(name);
-			int id; params.next(id);
-			users.erase(id);
-		}
-		else if (cmd == "msg") {
-			std::string name; params.next(name);
-			unreadMsgs++;
-			std::stringstream msg; msg << "Nieuw bericht van " << name;
-			notify(SITENAME, msg.str(), openUrl, false, false);
-		}
-		else if (cmd == "smsg") {
-			unreadMsgs++;
-		}
-		else if (cmd == "read") {
-			int readMsgs; params.next(readMsgs);
-			unreadMsgs -= readMsgs;
-		}
-		else if (cmd == "popup") {
-			std::string msg; params.tryNext(msg);
-			std::string url; params.tryNext(url);
-			std::string title; params.tryNext(title, SITENAME);
-			int sticky; params.tryNext(sticky);
-			int prio; params.tryNext(prio);
-			
-			notify(msg.length() ? title : "", msg, url, !!sticky, !!prio);
+		return false;
+	}
+
+	bool onOnline(StringRefTokenWalker& params)
+	{
+		StringRef name; params.next(name);
+		int id; params.next(id);
+		int silent; params.tryNext(silent, 0);
+		PresenceStore::Change change = users.setOnline(id, name);
+		if (change == PresenceStore::cameOnline && !silent) {
+			std::stringstream msg; msg << name.str() << " is nu online";
+			notifications.post(onlineNotifications, SITENAME, msg.str(), "http://" SITEHOST "/chat");
 		}
-		else {
-			std::cerr << "Unknown command from ILCS on streamUser callback: " << cmd << std::endl;
-			return;
+		if (change != PresenceStore::unchanged) {
+			stateVersion++;
+			if (!observers.empty()) {
+				std::string nameStr(name.str());
+				for (size_t i = 0; i < observers.size(); i++)
+					observers[i]->onUserOnline(stateVersion, id, nameStr);
+			}
 		}
-		
-		dataChanged();
-		
-		if (hadUsers != !!users.size() || hadMsgs != !!unreadMsgs)
-			statusChanged();
+		return true;
+	}
+
+	bool onOffline(StringRefTokenWalker& params)
+	{
+		params.skip(); // name
+		int id; params.next(id);
+		if (users.setOffline(id)) {
+			stateVersion++;
+			for (size_t i = 0; i < observers.size(); i++)
+				observers[i]->onUserOffline(stateVersion, id);
+		}
+		return true;
 	}
 
-	void cbStats(StringTokenWalker& params)
+	bool onMsg(StringRefTokenWalker& params)
 	{
-		std::string cmd; params.next(cmd);
+		StringRef name; params.next(name);
+		unreadMsgs++;
+		std::stringstream msg; msg << "Nieuw bericht van " << name.str();
+		notifications.post(msgNotifications, SITENAME, msg.str(), "http://" SITEHOST "/chat");
+		return true;
+	}
+
+	bool onSmsg(StringRefTokenWalker& params)
+	{
+		unreadMsgs++;
+		return true;
+	}
+
+	bool onRead(StringRefTokenWalker& params)
+	{
+		int readMsgs; params.next(readMsgs);
+		unreadMsgs -= readMsgs;
+		return true;
+	}
+
+	void cbStats(StringRefTokenWalker& params)
+	{
+		StringRef cmd; params.next(cmd);
 		
 		if (cmd == "stats") {
 			params.next(onlineUsers);
 			params.next(maleUsers);
 			params.next(femaleUsers);
 			
-			dataChanged();
+			markDataChanged();
 		}
 		else {
-			std::cerr << "Unknown command from ILCS on streamStats callback: " << cmd << std::endl;
+			std::cerr << "Unknown command from ILCS on streamStats callback: " << cmd.str() << std::endl;
 			return;
 		}
 	}
@@ -299,26 +586,467 @@ private:
 		Status oldStatus = status;
 		status = s;
 		if (oldStatus != status) {
-			if (status != s_enabled) {
+			// Restored state is kept while connecting, until the welcome.
+			if (status != s_enabled && !(stateStale && !reconcileTimer.get())) {
+				stateStale = false;
+				reconcileTimer.reset();
+				if (!users.empty()) {
+					stateVersion++;
+					for (size_t i = 0; i < observers.size(); i++)
+						observers[i]->onUsersCleared(stateVersion);
+				}
 				users.clear();
 				unreadMsgs = 0;
 			}
+			markDataChanged();
+			markStatusChanged();
+		}
+	}
+
+	// The callbacks of a single read from the stream form a batch. Within a batch, changes
+	// are only marked, and dataChanged and statusChanged run once at the end of it.
+	int batchDepth;
+	bool dataDirty;
+	bool statusDirty;
+
+	void beginBatch()
+	{
+		batchDepth++;
+	}
+
+	void endBatch()
+	{
+		if (--batchDepth > 0)
+			return;
+		if (dataDirty) {
+			dataDirty = false;
 			dataChanged();
+		}
+		if (statusDirty) {
+			statusDirty = false;
 			statusChanged();
 		}
 	}
 
+	void markDataChanged()
+	{
+		if (batchDepth) dataDirty = true;
+		else dataChanged();
+	}
+
+	void markStatusChanged()
+	{
+		if (batchDepth) statusDirty = true;
+		else statusChanged();
+	}
+
+	// Output stage {{{
+	// Icon and tooltip updates pass through here on their way to the frontend's icon() and
+	// tooltip(), which are expensive platform calls. Updates equal to what the frontend shows
+	// already are dropped. The others are emitted right away when nothing was emitted for
+	// outputInterval, and otherwise coalesced until the interval has passed, the last one
+	// winning.
+
+	boost::posix_time::time_duration outputInterval;
+	boost::scoped_ptr<boost::asio::deadline_timer> outputTimer;
+		// Running while the interval after an emit has not passed yet.
+
+	bool iconPending;
+	Icon pendingIcon;
+	bool iconShown;
+	Icon shownIcon;
+
+	bool tooltipPending;
+	std::list<std::string> pendingTooltip;
+	bool tooltipShown;
+	size_t shownTooltipHash;
+
+	void outputIcon(Icon i)
+	{
+		pendingIcon = i;
+		iconPending = true;
+		scheduleOutput();
+	}
+
+	void outputTooltip(std::list<std::string>& items)
+	{
+		pendingTooltip.swap(items);
+		tooltipPending = true;
+		scheduleOutput();
+	}
+
+	void scheduleOutput()
+	{
+		if (outputTimer.get())
+			return; // Emitted when the interval has passed
+		if (flushOutput() && outputInterval > boost::posix_time::time_duration()) {
+			outputTimer.reset(new boost::asio::deadline_timer(ioService));
+			outputTimer->expires_from_now(outputInterval);
+			outputTimer->async_wait(boost::bind(&Notifier::onOutputTimer, this, boost::asio::placeholders::error));
+		}
+	}
+
+	void onOutputTimer(const boost::system::error_code& err)
+	{
+		if (err == boost::asio::error::operation_aborted)
+			return;
+		outputTimer.reset();
+		scheduleOutput();
+	}
+
+	// Emits the pending updates that change anything. Returns whether anything was emitted.
+	bool flushOutput()
+	{
+		bool emitted = false;
+		if (iconPending) {
+			iconPending = false;
+			if (!iconShown || pendingIcon != shownIcon) {
+				iconShown = true;
+				shownIcon = pendingIcon;
+				icon(shownIcon);
+				emitted = true;
+			}
+		}
+		if (tooltipPending) {
+			tooltipPending = false;
+			size_t hash = boost::hash_range(pendingTooltip.begin(), pendingTooltip.end());
+			if (!tooltipShown || hash != shownTooltipHash) {
+				tooltipShown = true;
+				shownTooltipHash = hash;
+				tooltip(pendingTooltip);
+				emitted = true;
+			}
+		}
+		return emitted;
+	}
+	// }}}
+
+	// Observers {{{
+	std::vector<NotifierObserver*> observers;
+	unsigned stateVersion;
+
+	// State as last sent to the observers, for the changes that are sent per batch.
+	Status publishedStatus;
+	std::string publishedUserName;
+	int publishedUnreadMsgs;
+	int publishedStats[3];
+
+	// Sends the changes to status, unreadMsgs and the stats since the last call.
+	void publishState()
+	{
+		if (status != publishedStatus || userName != publishedUserName) {
+			publishedStatus = status;
+			publishedUserName = userName;
+			stateVersion++;
+			for (size_t i = 0; i < observers.size(); i++)
+				observers[i]->onStatusChanged(stateVersion, status, userName);
+		}
+		if (unreadMsgs != publishedUnreadMsgs) {
+			publishedUnreadMsgs = unreadMsgs;
+			stateVersion++;
+			for (size_t i = 0; i < observers.size(); i++)
+				observers[i]->onUnreadChanged(stateVersion, unreadMsgs);
+		}
+		if (onlineUsers != publishedStats[0] || maleUsers != publishedStats[1] || femaleUsers != publishedStats[2]) {
+			publishedStats[0] = onlineUsers;
+			publishedStats[1] = maleUsers;
+			publishedStats[2] = femaleUsers;
+			stateVersion++;
+			for (size_t i = 0; i < observers.size(); i++)
+				observers[i]->onStatsChanged(stateVersion, onlineUsers, maleUsers, femaleUsers);
+		}
+	}
+	// }}}
+
+	// Make-before-break reload {{{
+	// On "reload" the server is about to go away. While the current stream keeps running, a
+	// standby stream to another server connects, authenticates and subscribes to
+	// Notifier.streamUser, and on its welcome replaces the current stream. The contacts it
+	// reports online are reconciled with the ones shown as for a restored state, so nothing
+	// is cleared in between and no popups are shown for contacts that were online already.
+	// When the standby of a reload fails, gets another user or is not welcomed within
+	// RELOAD_TIMEOUT, we reconnect instead; when moving off a degraded server, we stay.
+
+	boost::shared_ptr<IlmpStream> standby;
+	size_t standbyServer;
+	bool standbyReload; // Whether the current stream is going away
+	IlmpCallback* standbyUserCb;
+	boost::scoped_ptr<boost::asio::deadline_timer> standbyTimer;
+
+	void startStandby(bool reload)
+	{
+		// Not preferring the current endpoint, as that is the server we move off.
+		standbyServer = servers.pick(server);
+		standbyReload = reload;
+		standby = createStream(standbyServer);
+		standby->onReady = boost::bind(&Notifier::onStandbyReady, this, standby.get());
+		standby->onError = boost::bind(&Notifier::onStandbyError, this, standby.get(), _1, _2);
+		standby->connect();
+
+		standbyTimer.reset(new boost::asio::deadline_timer(ioService));
+		standbyTimer->expires_from_now(boost::posix_time::milliseconds(RELOAD_TIMEOUT));
+		standbyTimer->async_wait(boost::bind(&Notifier::onStandbyTimer, this, boost::asio::placeholders::error));
+	}
+
+	void dropStandby()
+	{
+		standbyTimer.reset();
+		if (standby) {
+			standby->close();
+			standby.reset();
+		}
+	}
+
+	void onStandbyReady(IlmpStream* stream)
+	{
+		if (stream != standby.get())
+			return;
+		servers.connected(standbyServer, standby->connectLatency());
+		rpcUserClient(standby.get(), cookie, userAgent, boost::bind(&Notifier::cbStandbyClient, this, standby.get(), _1), 8);
+		rpcStreamStats(standby.get(), boost::bind(&Notifier::cbStats, this, _1));
+	}
+
+	void onStandbyError(IlmpStream* stream, int e, const std::string& msg)
+	{
+		if (stream != standby.get())
+			return; // Of a standby dropped before
+		std::cerr << "Standby stream error: " << msg << std::endl;
+		servers.failed(standbyServer);
+		standbyFailed();
+	}
+
+	void onStandbyTimer(const boost::system::error_code& err)
+	{
+		if (err == boost::asio::error::operation_aborted)
+			return;
+		std::cerr << "Standby stream not welcomed in time" << std::endl;
+		servers.failed(standbyServer);
+		standbyFailed();
+	}
+
+	// Drops the standby at once, so nothing it still delivers is acted upon; it is closed
+	// later, as this may run from within its callbacks.
+	void standbyFailed()
+	{
+		standbyTimer.reset();
+		boost::shared_ptr<IlmpStream> failed;
+		failed.swap(standby);
+		ioService.post(boost::bind(&IlmpStream::close, failed));
+		if (standbyReload)
+			reloadByReconnect();
+	}
+
+	// The standby's callbacks stay with the stream once it is promoted, and ignore what a
+	// dropped standby delivers.
+	void cbStandbyClient(IlmpStream* stream, StringRefTokenWalker& params)
+	{
+		StringRef cmd; params.next(cmd);
+		if (stream == ilmp.get() || (stream == standby.get() && cmd != "auth")) {
+			runClientCommand(cmd, params);
+			return;
+		}
+		if (stream != standby.get())
+			return;
+
+		std::string standbyCookie; params.next(standbyCookie);
+		int standbyUserId; params.next(standbyUserId);
+		if (standbyUserId != userId) {
+			std::cerr << "Standby stream got another user" << std::endl;
+			standbyFailed();
+			return;
+		}
+		cookie = standbyCookie;
+		setConfigValue("cookie", cookie);
+		rpcStreamUser(standby.get(), IlmpRpcCallback(boost::bind(&Notifier::cbStandbyUser, this, standby.get(), _1), &standbyUserCb));
+	}
+
+	void cbStandbyUser(IlmpStream* stream, StringRefTokenWalker& params)
+	{
+		StringRef cmd; params.next(cmd);
+		if (stream == standby.get()) {
+			if (cmd != "welcome")
+				return; // Still delivered by the current stream
+			promoteStandby();
+		}
+		else if (stream != ilmp.get())
+			return;
+		runUserCommand(cmd, params);
+	}
+
+	// Replaces the current stream by the standby, ahead of handling its welcome.
+	void promoteStandby()
+	{
+		standbyTimer.reset();
+		reconnectTimer.reset(); // E.g. of an error on the current stream in the meantime
+		ilmp->close(); // Resets userCb
+		ilmp = standby;
+		server = standbyServer;
+		standby.reset();
+		ilmp->onReady = boost::bind(&Notifier::onIlmpReady, this);
+		ilmp->onError = boost::bind(&Notifier::onIlmpError, this, ilmp.get(), _1, _2);
+		preferredEndpoint = ilmp->remoteEndpoint();
+
+		userCb = standbyUserCb;
+		userCb->removeWeakRef(&standbyUserCb);
+		userCb->addWeakRef(&userCb);
+		standbyUserCb = 0;
+
+		// onWelcome reconciles the contacts shown with the ones the new stream reports.
+		reconcileTimer.reset();
+		stateStale = true;
+	}
+	// }}}
+
+	// State cache {{{
+	// The state shown is saved to stateCachePath() on quit() and every STATE_SAVE_INTERVAL
+	// when it changed, and restored on the next start before connecting, so the last known
+	// contacts and messages show right away. The restored state is stale until the server
+	// confirms it: it is kept while connecting, and the contacts that are not reported
+	// online again within STATE_RECONCILE_GRACE after the welcome are dropped. A restored
+	// state of another user is dropped on auth.
+
+	bool stateStale;
+	int cachedUserId;
+	unsigned savedVersion;
+	tcp::endpoint preferredEndpoint; // Last connected to, tried first on connect
+	boost::scoped_ptr<boost::asio::deadline_timer> saveTimer;
+	boost::scoped_ptr<boost::asio::deadline_timer> reconcileTimer;
+
+	void restoreState()
+	{
+		std::string path(stateCachePath());
+		CachedState state;
+		if (path.empty() || !StateCache::load(path, state) || !state.userId)
+			return;
+
+		stateStale = true;
+		cachedUserId = state.userId;
+		userName = state.userName;
+		unreadMsgs = state.unreadMsgs;
+		onlineUsers = state.onlineUsers;
+		maleUsers = state.maleUsers;
+		femaleUsers = state.femaleUsers;
+
+		boost::system::error_code err;
+		boost::asio::ip::address address = boost::asio::ip::address::from_string(state.endpointAddress, err);
+		if (!err) preferredEndpoint = tcp::endpoint(address, state.endpointPort);
+
+		// Listed least recently online first, so they are linked in the same order.
+		for (std::vector<std::pair<int, std::string> >::reverse_iterator it = state.users.rbegin(); it != state.users.rend(); it++) {
+			users.setOnline(it->first, it->second);
+			stateVersion++;
+			for (size_t i = 0; i < observers.size(); i++)
+				observers[i]->onUserOnline(stateVersion, it->first, it->second);
+		}
+		savedVersion = stateVersion;
+
+#ifdef DEBUG
+		std::cout << "Restored state of " << userName << " from " << path << std::endl;
+#endif
+		markDataChanged();
+		markStatusChanged();
+	}
+
+	// Saves the state when it is confirmed by the server and changed since the last save.
+	void saveState()
+	{
+		std::string path(stateCachePath());
+		if (path.empty() || status != s_enabled || stateStale || savedVersion == stateVersion)
+			return;
+
+		CachedState state;
+		state.userId = userId;
+		state.userName = userName;
+		state.unreadMsgs = unreadMsgs;
+		state.onlineUsers = onlineUsers;
+		state.maleUsers = maleUsers;
+		state.femaleUsers = femaleUsers;
+		state.endpointAddress = preferredEndpoint.port() ? preferredEndpoint.address().to_string() : "";
+		state.endpointPort = preferredEndpoint.port();
+		users.getOnline(state.users);
+		if (StateCache::save(path, state))
+			savedVersion = stateVersion;
+	}
+
+	void scheduleSave()
+	{
+		saveTimer.reset(new boost::asio::deadline_timer(ioService));
+		saveTimer->expires_from_now(boost::posix_time::milliseconds(STATE_SAVE_INTERVAL));
+		saveTimer->async_wait(boost::bind(&Notifier::onSaveTimer, this, boost::asio::placeholders::error));
+	}
+
+	void onSaveTimer(const boost::system::error_code& err)
+	{
+		if (err == boost::asio::error::operation_aborted)
+			return;
+		saveState();
+		scheduleSave();
+	}
+
+	void onReconcileTimer(const boost::system::error_code& err)
+	{
+		if (err == boost::asio::error::operation_aborted)
+			return;
+		reconcileTimer.reset();
+		stateStale = false;
+
+		std::vector<int> removed;
+		users.removeStale(removed);
+		for (std::vector<int>::iterator it = removed.begin(); it != removed.end(); it++) {
+			stateVersion++;
+			for (size_t i = 0; i < observers.size(); i++)
+				observers[i]->onUserOffline(stateVersion, *it);
+		}
+		markDataChanged();
+		markStatusChanged();
+	}
+
+	void dropRestoredState()
+	{
+		stateStale = false;
+		reconcileTimer.reset();
+		if (!users.empty()) {
+			stateVersion++;
+			for (size_t i = 0; i < observers.size(); i++)
+				observers[i]->onUsersCleared(stateVersion);
+		}
+		users.clear();
+		userName = "";
+		unreadMsgs = 0;
+		markDataChanged();
+		markStatusChanged();
+	}
+	// }}}
+
 	// runloopWork will force our ioService to keep running until we quit().
 	boost::asio::io_service::work *runloopWork;
 public:
 #ifndef USERAGENT
 	#define USERAGENT "Notifier [unknown; " __DATE__ ", " __TIME__ "]"
 #endif
-	Notifier(boost::asio::io_service& ioService_) : ioService(ioService_), isEnabled(true),
+	Notifier(boost::asio::io_service& ioService_) : ioService(ioService_), status(s_disconnected),
 			userAgent(USERAGENT), cookie(""), userId(0),
 			userName(""), unreadMsgs(0), maleUsers(0), femaleUsers(0), onlineUsers(0),
-			status(s_disconnected), retryTime(5), retries(3), userCb(0), reconnectTimer(),
-			isUpdating(false), neededAuthorization(false) {
+			isUpdating(false), neededAuthorization(false),
+			notifications(ioService_, boost::bind(&Notifier::notify, this, _1, _2, _3, false, false)),
+			rpcLog("Notifier.log"), rpcCheckForUpdate("Notifier.checkForUpdate"), rpcUserClient("User.client"),
+			rpcStreamStats("Notifier.streamStats"), rpcStreamUser("Notifier.streamUser"),
+			rpcKillByCookie("Client.killByCookie"), isEnabled(true), retries(3), reconnectTimer(),
+			speculativeUserId(0), servers(ILMPSERVERS), server(0), userCb(0),
+			batchDepth(0), dataDirty(false), statusDirty(false),
+			outputInterval(boost::posix_time::milliseconds(OUTPUT_INTERVAL)), iconPending(false), iconShown(false),
+			tooltipPending(false), tooltipShown(false),
+			stateVersion(0), publishedStatus(s_disconnected), publishedUnreadMsgs(0),
+			standbyServer(0), standbyReload(false), standbyUserCb(0),
+			stateStale(false), cachedUserId(0), savedVersion(0) {
+
+		initCommands();
+
+		publishedStats[0] = publishedStats[1] = publishedStats[2] = 0;
+
+		// At most 3 popups at once, then one per 10 (online) or 5 (messages) seconds.
+		onlineNotifications = notifications.addCategory(" contacten online", NOTIFY_WINDOW, 3, 10000);
+		msgNotifications = notifications.addCategory(" nieuwe berichten", NOTIFY_WINDOW, 3, 5000);
 
 		runloopWork = new boost::asio::io_service::work(ioService);
 	}
@@ -327,12 +1055,15 @@ public:
 #ifdef DEBUG
 		std::cout << "initialize" << std::endl;
 #endif
+		restoreState();
+		if (!stateCachePath().empty())
+			scheduleSave();
 		connect();
 	}
 
 	void logout()
 	{
-		if (ilmp) (IlmpCommand(ilmp.get(), "Client.killByCookie") << cookie).send();
+		if (ilmp) rpcKillByCookie(ilmp.get(), cookie);
 		setEnabled(false,true);
 	}
 
@@ -343,6 +1074,10 @@ public:
 #endif
 
 		isEnabled = enabled;
+		if (!isEnabled && stateStale)
+			dropRestoredState();
+		if (!isEnabled)
+			dropStandby();
 		
 		if (status == s_disconnected) reconnect();
 		else if (status != s_connecting) {
@@ -359,7 +1094,7 @@ public:
 				else notify(APPNAME, "Klik hier om in te loggen.", loginUrl.str(), true, true);
 			}
 			else if (isEnabled && !userCb)
-				(IlmpCommand(ilmp.get(), "Notifier.streamUser") << boost::bind(&Notifier::cbUser, this, _1) >> &userCb).send();
+				rpcStreamUser(ilmp.get(), IlmpRpcCallback(boost::bind(&Notifier::cbUser, this, _1), &userCb));
 
 			if (!isEnabled) toStatus(s_connected);
 				// To accomodate the s_enabled > s_connected transition. s_connected > s_enabled is
@@ -369,13 +1104,14 @@ public:
 
 	void reconnect()
 	{
-		retryTime = 5;
+		reconnects.succeeded();
 		connect();
 	}
 
 	void disconnect()
 	{
 		reconnectTimer.reset();
+		dropStandby();
 		if (ilmp) {
 			ilmp->close();
 			ilmp.reset();
@@ -385,9 +1121,16 @@ public:
 
 	virtual void quit()
 	{
+		saveState();
+		saveTimer.reset();
+		reconcileTimer.reset();
+		dropStandby();
 		if (ilmp) ilmp->close();
 		ilmp.reset();
 		reconnectTimer.reset();
+		outputTimer.reset();
+		notifications.cancel();
+		IlmpResolverCache::instance().stop();
 		delete runloopWork;
 	}
 
@@ -407,18 +1150,55 @@ public:
 		notify(APPNAME, msg.str(), "http://opensource.implicit-link.com/", false, true);
 	}
 
+	// Fills snapshot with the current state.
+	void snapshot(NotifierSnapshot& snapshot) const
+	{
+		snapshot.version = stateVersion;
+		snapshot.status = status;
+		snapshot.userName = userName;
+		snapshot.unreadMsgs = unreadMsgs;
+		snapshot.onlineUsers = onlineUsers;
+		snapshot.maleUsers = maleUsers;
+		snapshot.femaleUsers = femaleUsers;
+		snapshot.users.clear();
+		users.getOnline(snapshot.users);
+	}
+
+	// Adds an observer, which first receives a snapshot. Observers are not owned, and must
+	// not be added or removed from within their callbacks.
+	void addObserver(NotifierObserver* observer)
+	{
+		NotifierSnapshot s;
+		snapshot(s);
+		observers.push_back(observer);
+		observer->onSnapshot(s);
+	}
+
+	void removeObserver(NotifierObserver* observer)
+	{
+		observers.erase(std::remove(observers.begin(), observers.end(), observer), observers.end());
+	}
+
+	// Sets the minimum time between two icon or tooltip updates; 0 disables coalescing.
+	void setOutputInterval(int ms)
+	{
+		outputInterval = boost::posix_time::milliseconds(ms);
+	}
+
 	// Invoked when any of status, !!users.size(), !!unreadMsgs changes.
 	virtual void statusChanged()
 	{
-		if (unreadMsgs) icon(i_msgs);
-		else if (users.size()) icon(i_users);
-		else if (status == s_enabled) icon(i_normal);
-		else icon(i_disabled);
+		if (unreadMsgs) outputIcon(i_msgs);
+		else if (users.size()) outputIcon(i_users);
+		else if (status == s_enabled) outputIcon(i_normal);
+		else outputIcon(i_disabled);
 	}
 
 	// Invoked when any of status, maleUsers, femaleUsers, onlineUsers, isUpdating, users, unreadMsgs changes
 	virtual void dataChanged()
 	{
+		publishState();
+
 		std::list<std::string> ttItems;
 		
 		if (isUpdating)
@@ -436,6 +1216,9 @@ public:
 		if (connectError.size())
 			ttItems.push_back(connectError);
 
+		if (stateStale && status != s_enabled)
+			ttItems.push_back("Gegevens van de vorige sessie");
+
 		if (unreadMsgs > 0) {
 			std::stringstream unreadStr;
 			unreadStr << unreadMsgs << (unreadMsgs == 1 ? " nieuw bericht" : " nieuwe berichten");
@@ -443,14 +1226,16 @@ public:
 		}
 
 		if (users.size() > 0) {
-			std::list<std::string> userNames;
-			for (std::map<int,User>::iterator i = users.begin(); i != users.end(); i++) {
-				userNames.push_back((*i).second.second);
+			std::string userNames;
+			size_t listed = users.appendNames(userNames, TOOLTIP_USERS);
+			if (listed < users.size()) {
+				std::stringstream others; others << " en " << (users.size() - listed) << " anderen";
+				userNames.append(others.str());
 			}
 			
 			std::stringstream onlineStr;
 			onlineStr << users.size() << (users.size() == 1 ? " contact online (" : " contacten online (")
-			          << boost::algorithm::join(userNames, ", ") << ")";
+			          << userNames << ")";
 					
 			ttItems.push_back(onlineStr.str());
 		}
@@ -463,7 +1248,7 @@ public:
 			ttItems.push_back(statsStr2.str());
 		}
 
-		tooltip(ttItems);
+		outputTooltip(ttItems);
 	}
 
 	virtual void openUrl(const std::string&) { }
@@ -476,13 +1261,19 @@ public:
 	virtual std::string getConfigValue(const std::string& name) { return ""; }
 	virtual bool setConfigValue(const std::string& name, const std::string& value) { return false; }
 
+	// File the state is saved to between runs; none when empty.
+	virtual std::string stateCachePath() { return ""; }
+
 
 	// Update logic {{{
 	
 	typedef boost::function<void(boost::asio::streambuf*)> FetchCallback;
 
 #ifdef DSA_PUBLIC_KEY
-	void updateAvailable(StringTokenWalker& params)
+	IlmpHandlerMemory fetchMemory;
+		// Handler memory for the fetcher's operations; a fetch runs one operation at a time.
+
+	void updateAvailable(StringRefTokenWalker& params)
 	{
 		// Update push on backend protocol level.
 		std::string updateUrl; params.tryNext(updateUrl, "");
@@ -492,53 +1283,36 @@ public:
 	void fetch(std::string &host, std::string &port, std::string &path, FetchCallback cb)
 	{
 		// Asynchronous http fetch		
-		tcp::resolver *resolver = new tcp::resolver(ioService);
-		
-		tcp::resolver::query query(host, port);
-		resolver->async_resolve(query, boost::bind(&Notifier::fetchOnResolve, this,
-				resolver, host, path, cb, boost::asio::placeholders::error, boost::asio::placeholders::iterator));
+		IlmpResolverCache::instance().resolve(ioService, host, port, boost::bind(&Notifier::fetchOnResolve, this,
+				host, port, path, cb, _1, _2));
 	}
 	
-	void fetchOnResolve(tcp::resolver *resolver, std::string &host, std::string &path, FetchCallback cb,
-			const boost::system::error_code& err, tcp::resolver::iterator endpoint_itr)
+	void fetchOnResolve(std::string &host, std::string &port, std::string &path, FetchCallback cb,
+			const boost::system::error_code& err, const IlmpResolverCache::Endpoints& endpoints)
 	{
 		if (err) {
 			if (err == boost::asio::error::operation_aborted) std::cerr << "Fetcher: aborted" << std::endl;
 			else std::cerr << "Fetcher: unable to resolve hostname" << std::endl;
 			
-			delete resolver;
 			cb(0);
 			return;
 		}
 		
-		tcp::socket *socket = new tcp::socket(ioService);
-		
-		tcp::endpoint endpoint = *endpoint_itr;
-		socket->async_connect(endpoint, boost::bind(&Notifier::fetchOnConnect, this,
-				resolver, socket, host, path, cb, boost::asio::placeholders::error, ++endpoint_itr));
+		boost::shared_ptr<IlmpConnector> connector(new IlmpConnector(ioService));
+		connector->connect(endpoints, IlmpResolverCache::instance().good(host, port), boost::bind(&Notifier::fetchOnConnect, this,
+				host, port, path, cb, _1, _2));
 	}
 	
-	void fetchOnConnect(tcp::resolver *resolver, tcp::socket *socket, std::string &host, std::string &path,
-			FetchCallback cb, const boost::system::error_code& err, tcp::resolver::iterator endpoint_itr)
+	void fetchOnConnect(std::string &host, std::string &port, std::string &path,
+			FetchCallback cb, const boost::system::error_code& err, tcp::socket *socket)
 	{
-		if (err == boost::asio::error::operation_aborted) {
-			std::cerr << "Fetcher: aborted" << std::endl;
-			delete resolver;
-			delete socket;
+		if (err) {
+			std::cerr << "Fetcher: unable to connect to " << host << ": " << err.message() << std::endl;
 			cb(0);
 			return;
 		}
-		else if (err && endpoint_itr != tcp::resolver::iterator()) {
-			// Connection failed, but we can try the next endpoint.
-			socket->close();
-			tcp::endpoint endpoint = *endpoint_itr;
-			std::cerr << "Fetcher: unable to connect to '" << endpoint << "'; trying next endpoint" << std::endl;
-			socket->async_connect(endpoint, boost::bind(&Notifier::fetchOnConnect, this,
-					resolver, socket, host, path, cb, boost::asio::placeholders::error, ++endpoint_itr));
-			return;
-		}
-		
-		delete resolver;
+		boost::system::error_code endpointErr;
+		IlmpResolverCache::instance().setGood(host, port, socket->remote_endpoint(endpointErr));
 		
 		boost::asio::streambuf request;
 		std::ostream request_stream(&request);
@@ -550,8 +1324,8 @@ public:
 		boost::asio::streambuf* responseBuf = new boost::asio::streambuf;
 
 		// Read headers
-		boost::asio::async_read_until(*socket, *responseBuf, "\r\n\r\n", boost::bind(&Notifier::fetchOnHeaders,
-				this, socket, responseBuf, cb, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+		boost::asio::async_read_until(*socket, *responseBuf, "\r\n\r\n", makeAllocHandler(fetchMemory, boost::bind(&Notifier::fetchOnHeaders,
+				this, socket, responseBuf, cb, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
 	}
 	
 	void fetchOnHeaders(tcp::socket *socket, boost::asio::streambuf* responseBuf, FetchCallback cb,
@@ -571,8 +1345,8 @@ public:
 		responseBuf->consume(transferred); // Discard headers
 		
 		// From now on, read till EOF
-		boost::asio::async_read(*socket, *responseBuf, boost::bind(&Notifier::fetchOnData,
-				this, socket, responseBuf, cb, boost::asio::placeholders::error));
+		boost::asio::async_read(*socket, *responseBuf, makeAllocHandler(fetchMemory, boost::bind(&Notifier::fetchOnData,
+				this, socket, responseBuf, cb, boost::asio::placeholders::error)));
 	}
 	
 	void fetchOnData(tcp::socket *socket, boost::asio::streambuf* responseBuf, FetchCallback cb, const boost::system::error_code& err)
@@ -591,8 +1365,8 @@ public:
 		}
 		else {
 			// Wait for more data
-			boost::asio::async_read(*socket, *responseBuf, boost::bind(&Notifier::fetchOnData,
-					this, socket, responseBuf, cb, boost::asio::placeholders::error));
+			boost::asio::async_read(*socket, *responseBuf, makeAllocHandler(fetchMemory, boost::bind(&Notifier::fetchOnData,
+					this, socket, responseBuf, cb, boost::asio::placeholders::error)));
 		}
 	}
 
@@ -0,0 +1,240 @@
+/*
+ * Paiq notifier framework - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PRESENCE_STORE_H
+#define PRESENCE_STORE_H
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "../ext/ilmpclient/TokenWalker.h"
+
+// PresenceStore keeps track of which contacts are online, for accounts with many contacts.
+//
+// Contacts live in a flat vector and are found by id through an open-addressing index;
+// names are interned the same way, so a contact going on- and offline repeatedly (as on
+// the replay after a reconnect) does not allocate. The online contacts are linked in
+// order of coming online, so the most recent ones can be listed without walking or
+// sorting everything. All updates are O(1); clear() keeps the tables' capacity for reuse.
+class PresenceStore {
+public:
+	PresenceStore() : head(-1), online(0) {}
+
+	// Number of contacts online.
+	size_t size() const { return online; }
+	bool empty() const { return !online; }
+
+	enum Change {
+		unchanged,
+		renamed, // Was online under another name
+		cameOnline
+	};
+
+	// Marks contact id online under name.
+	Change setOnline(int id, const StringRef& name)
+	{
+		int c = findContact(id, true);
+		int n = intern(name);
+		bool rename = contacts[c].name != n;
+		contacts[c].name = n;
+		contacts[c].stale = false;
+		if (contacts[c].online)
+			return rename ? renamed : unchanged;
+		contacts[c].online = true;
+		link(c);
+		online++;
+		return cameOnline;
+	}
+
+	// Marks contact id offline. Returns whether it was online before.
+	bool setOffline(int id)
+	{
+		int c = findContact(id, false);
+		if (c < 0 || !contacts[c].online)
+			return false;
+		contacts[c].online = false;
+		unlink(c);
+		online--;
+		return true;
+	}
+
+	// Marks all online contacts stale, until they are set online again.
+	void markAllStale()
+	{
+		for (int c = head; c >= 0; c = contacts[c].next)
+			contacts[c].stale = true;
+	}
+
+	// Sets the online contacts that are still stale offline, appending their ids to removed.
+	void removeStale(std::vector<int>& removed)
+	{
+		for (int c = head, next; c >= 0; c = next) {
+			next = contacts[c].next;
+			if (contacts[c].stale) {
+				removed.push_back(contacts[c].id);
+				contacts[c].online = contacts[c].stale = false;
+				unlink(c);
+				online--;
+			}
+		}
+	}
+
+	void clear()
+	{
+		contacts.clear();
+		contactIndex.clear();
+		names.clear();
+		nameIndex.clear();
+		head = -1;
+		online = 0;
+	}
+
+	// Appends the names of at most max online contacts to out, most recently online first,
+	// separated by ", ". Returns the number of names appended.
+	size_t appendNames(std::string& out, size_t max) const
+	{
+		size_t n = 0;
+		for (int c = head; c >= 0 && n < max; c = contacts[c].next, n++) {
+			if (n) out.append(", ");
+			out.append(names[contacts[c].name]);
+		}
+		return n;
+	}
+
+	// Appends the (id, name) of all online contacts to out, most recently online first.
+	void getOnline(std::vector<std::pair<int, std::string> >& out) const
+	{
+		for (int c = head; c >= 0; c = contacts[c].next)
+			out.push_back(std::make_pair(contacts[c].id, names[contacts[c].name]));
+	}
+
+private:
+	struct Contact {
+		int id;
+		int name; // Index into names
+		bool online;
+		bool stale; // Online as restored, not confirmed since
+		int prev, next; // Neighbours in the list of online contacts, or -1
+	};
+
+	std::vector<Contact> contacts;
+	std::vector<std::string> names;
+
+	// Open-addressing indices into contacts and names, holding index + 1 (0 is a free
+	// slot). Entries are never removed but by clear(), so linear probing needs no
+	// tombstones. The tables are kept at most half full.
+	std::vector<int> contactIndex;
+	std::vector<int> nameIndex;
+
+	int head; // Most recently online contact, or -1
+	size_t online;
+
+	static size_t hashId(int id)
+	{
+		unsigned h = (unsigned)id * 2654435761u;
+		return h ^ (h >> 16);
+	}
+
+	static size_t hashName(const StringRef& s)
+	{
+		unsigned h = 2166136261u;
+		for (const char* p = s.begin(); p != s.end(); p++) {
+			h ^= (unsigned char)*p;
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	// Returns the index of contact id in contacts, adding it when create is set; -1 when
+	// it is not there.
+	int findContact(int id, bool create)
+	{
+		if (contactIndex.empty()) {
+			if (!create) return -1;
+			contactIndex.assign(16, 0);
+		}
+		size_t mask = contactIndex.size() - 1;
+		size_t i = hashId(id) & mask;
+		for (; contactIndex[i]; i = (i + 1) & mask) {
+			if (contacts[contactIndex[i] - 1].id == id)
+				return contactIndex[i] - 1;
+		}
+		if (!create)
+			return -1;
+
+		Contact contact = { id, 0, false, false, -1, -1 };
+		contacts.push_back(contact);
+		contactIndex[i] = contacts.size();
+		if (contacts.size() * 2 > contactIndex.size()) {
+			contactIndex.assign(contactIndex.size() * 2, 0);
+			mask = contactIndex.size() - 1;
+			for (size_t c = 0; c < contacts.size(); c++) {
+				size_t j = hashId(contacts[c].id) & mask;
+				while (contactIndex[j]) j = (j + 1) & mask;
+				contactIndex[j] = c + 1;
+			}
+		}
+		return contacts.size() - 1;
+	}
+
+	// Returns the index of name in names, adding it when it is new.
+	int intern(const StringRef& name)
+	{
+		if (nameIndex.empty())
+			nameIndex.assign(16, 0);
+		size_t mask = nameIndex.size() - 1;
+		size_t i = hashName(name) & mask;
+		for (; nameIndex[i]; i = (i + 1) & mask) {
+			if (StringRef(names[nameIndex[i] - 1]) == name)
+				return nameIndex[i] - 1;
+		}
+
+		names.push_back(name.str());
+		nameIndex[i] = names.size();
+		if (names.size() * 2 > nameIndex.size()) {
+			nameIndex.assign(nameIndex.size() * 2, 0);
+			mask = nameIndex.size() - 1;
+			for (size_t n = 0; n < names.size(); n++) {
+				size_t j = hashName(names[n]) & mask;
+				while (nameIndex[j]) j = (j + 1) & mask;
+				nameIndex[j] = n + 1;
+			}
+		}
+		return names.size() - 1;
+	}
+
+	void link(int c)
+	{
+		contacts[c].prev = -1;
+		contacts[c].next = head;
+		if (head >= 0) contacts[head].prev = c;
+		head = c;
+	}
+
+	void unlink(int c)
+	{
+		Contact& contact = contacts[c];
+		if (contact.prev >= 0) contacts[contact.prev].next = contact.next;
+		else head = contact.next;
+		if (contact.next >= 0) contacts[contact.next].prev = contact.prev;
+		contact.prev = contact.next = -1;
+	}
+};
+
+#endif
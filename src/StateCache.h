@@ -0,0 +1,169 @@
+/*
+ * Paiq notifier framework - http://opensource.implicit-link.com/
+ * Copyright (c) 2010 Implicit Link
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATE_CACHE_H
+#define STATE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// The state a Notifier shows, as saved between runs so it can be shown right away on the
+// next start, before the connection is up.
+struct CachedState {
+	int userId;
+	std::string userName;
+	int unreadMsgs;
+	int onlineUsers;
+	int maleUsers;
+	int femaleUsers;
+	std::string endpointAddress; // Server endpoint last connected to, if any
+	int endpointPort;
+	std::vector<std::pair<int, std::string> > users; // Online contacts, most recently online first
+};
+
+// StateCache saves a CachedState to a file and loads it through a memory mapping. The
+// file holds a small header followed by the fields, integers as 4 bytes in little-endian
+// order and strings prefixed with their length. A file that does not check out is ignored.
+class StateCache {
+public:
+	static bool save(const std::string& path, const CachedState& state)
+	{
+		std::vector<char> data;
+		putInt(data, magic);
+		putInt(data, formatVersion);
+		putInt(data, 0); // Size, filled in below
+		putInt(data, state.userId);
+		putString(data, state.userName);
+		putInt(data, state.unreadMsgs);
+		putInt(data, state.onlineUsers);
+		putInt(data, state.maleUsers);
+		putInt(data, state.femaleUsers);
+		putString(data, state.endpointAddress);
+		putInt(data, state.endpointPort);
+		putInt(data, state.users.size());
+		for (std::vector<std::pair<int, std::string> >::const_iterator it = state.users.begin(); it != state.users.end(); it++) {
+			putInt(data, it->first);
+			putString(data, it->second);
+		}
+		setInt(&data[8], data.size());
+
+		// Written to a temporary file first, so a crash halfway leaves the old one intact.
+		std::string tmpPath(path + ".tmp");
+		{
+			std::ofstream file(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+			file.write(&data[0], data.size());
+			file.close();
+			if (!file) {
+				std::cerr << "Unable to save state to " << tmpPath << std::endl;
+				return false;
+			}
+		}
+#ifdef _WIN32
+		std::remove(path.c_str()); // rename does not replace on Windows
+#endif
+		return std::rename(tmpPath.c_str(), path.c_str()) == 0;
+	}
+
+	static bool load(const std::string& path, CachedState& state)
+	{
+		try {
+			boost::interprocess::file_mapping mapping(path.c_str(), boost::interprocess::read_only);
+			boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
+			Reader r(static_cast<const char*>(region.get_address()), region.get_size());
+
+			int m, v, size, users;
+			if (!r.getInt(m) || m != magic || !r.getInt(v) || v != formatVersion
+					|| !r.getInt(size) || size != (int)region.get_size())
+				return false;
+			if (!r.getInt(state.userId) || !r.getString(state.userName) || !r.getInt(state.unreadMsgs)
+					|| !r.getInt(state.onlineUsers) || !r.getInt(state.maleUsers) || !r.getInt(state.femaleUsers)
+					|| !r.getString(state.endpointAddress) || !r.getInt(state.endpointPort) || !r.getInt(users) || users < 0)
+				return false;
+			state.users.clear();
+			for (int i = 0; i < users; i++) {
+				state.users.push_back(std::make_pair(0, std::string()));
+				if (!r.getInt(state.users.back().first) || !r.getString(state.users.back().second))
+					return false;
+			}
+			return true;
+		}
+		catch (const boost::interprocess::interprocess_exception&) {
+			return false; // No cache yet, most likely
+		}
+	}
+
+private:
+	static const int magic = 0x43535150; // "PQSC"
+	static const int formatVersion = 1;
+
+	static void setInt(char* p, unsigned int i)
+	{
+		for (int b = 0; b < 4; b++)
+			p[b] = (char)(i >> (8 * b));
+	}
+
+	static void putInt(std::vector<char>& data, int i)
+	{
+		data.resize(data.size() + 4);
+		setInt(&data[data.size() - 4], i);
+	}
+
+	static void putString(std::vector<char>& data, const std::string& s)
+	{
+		putInt(data, s.size());
+		data.insert(data.end(), s.begin(), s.end());
+	}
+
+	class Reader {
+	public:
+		Reader(const char* data, size_t size) : p(data), end(data + size) {}
+
+		bool getInt(int& i)
+		{
+			if (end - p < 4) return false;
+			unsigned int u = 0;
+			for (int b = 0; b < 4; b++)
+				u |= (unsigned int)(unsigned char)p[b] << (8 * b);
+			i = (int)u;
+			p += 4;
+			return true;
+		}
+
+		bool getString(std::string& s)
+		{
+			int size;
+			if (!getInt(size) || size < 0 || end - p < size) return false;
+			s.assign(p, size);
+			p += size;
+			return true;
+		}
+
+	private:
+		const char* p;
+		const char* end;
+	};
+};
+
+#endif